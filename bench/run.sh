@@ -0,0 +1,7 @@
+#!/bin/sh
+# Build the benchmark harness and run it; JSON on stdout.
+#   bench/run.sh [--iters N] [--ballast MB] > results.json
+set -e
+dir=$(cd "$(dirname "$0")" && pwd)
+${CC:-cc} -O2 -Wall -o "$dir/shellbench" "$dir/shellbench.c"
+exec "$dir/shellbench" "$@"
@@ -0,0 +1,305 @@
+// Launch-latency and hot-path benchmarks for mysh.
+//
+// The shell is a single translation unit, so the bench compiles it in
+// directly and drives its internals (launch_stage, parse_line, the job
+// table, history) without going through a prompt. Results go to stdout
+// as one JSON document; progress and errors go to stderr.
+//
+//   ./shellbench [--iters N] [--ballast MB]
+//
+// --ballast maps and touches MB of memory first, to show what fork() pays
+// for page tables in a large parent compared with posix_spawn().
+#define main minishell_main
+#include "../minishell.c"
+#undef main
+
+static long iters = 200;
+static bool first_result = true;
+
+static long long now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// One result object. samples are sorted in place for the percentiles.
+static void emit(const char *name, const char *variant, long n, long long *samples, long count) {
+    qsort(samples, (size_t)count, sizeof(long long), cmp_ll);
+    long long sum = 0;
+    for (long i=0;i<count;i++) sum += samples[i];
+    printf("%s\n    {\"name\": \"%s\", \"variant\": \"%s\", \"n\": %ld, \"samples\": %ld, "
+           "\"mean_ns\": %lld, \"p50_ns\": %lld, \"p90_ns\": %lld, \"p99_ns\": %lld}",
+           first_result ? "" : ",", name, variant, n, count, count ? sum / count : 0,
+           samples[count/2], samples[count*9/10], samples[count*99/100]);
+    first_result = false;
+    fflush(stdout);
+}
+
+// A single timed figure, for things that only make sense once (a load).
+static void emit_once(const char *name, const char *variant, long n, long long ns) {
+    emit(name, variant, n, &ns, 1);
+}
+
+// ---------- launch latency ----------
+// The probe is this binary re-executed with --probe: the first thing its
+// main does is write CLOCK_MONOTONIC to stdout, which is a pipe back to us.
+static void bench_launch(const char *self_name, launcher_kind kind, bool hashed) {
+    long long *first = malloc(sizeof(long long) * (size_t)iters);
+    long long *total = malloc(sizeof(long long) * (size_t)iters);
+    launcher = kind;
+    hash_clear();
+    for (long it = 0; it < iters; it++) {
+        int pipes[1][2];
+        if (pipe2(pipes[0], O_CLOEXEC) < 0) { perror("pipe"); exit(1); }
+        char *argv[] = { (char *)self_name, "--probe", NULL };
+        Command cmd = { .argv = argv };
+        Stage st = { .in_fd = -1, .out_fd = pipes[0][1], .pgid = -1, .cgroup_fd = -1 };
+        const char *path = hashed ? hash_lookup(self_name) : NULL;
+
+        long long t0 = now_ns();
+        pid_t pid = launch_stage(&cmd, path, &st);
+        close(pipes[0][1]);
+        long long t_child = 0;
+        if (pid < 0 || read(pipes[0][0], &t_child, sizeof(t_child)) != sizeof(t_child)) {
+            fprintf(stderr, "shellbench: probe failed\n");
+            exit(1);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        long long t1 = now_ns();
+        close(pipes[0][0]);
+        first[it] = t_child - t0;
+        total[it] = t1 - t0;
+    }
+    char variant[64];
+    snprintf(variant, sizeof(variant), "%s%s", kind == LAUNCH_SPAWN ? "spawn" : "fork",
+             hashed ? "+hash" : "+pathsearch");
+    emit("launch_to_first_instruction", variant, 1, first, iters);
+    emit("launch_to_exit", variant, 1, total, iters);
+    free(first); free(total);
+}
+
+// ---------- pipelines ----------
+static void bench_pipeline(launcher_kind kind) {
+    Arena a = { 0 };
+    long long *t = malloc(sizeof(long long) * (size_t)iters);
+    launcher = kind;
+    for (int n = 1; n <= 64; n *= 2) {
+        char line[64 * 8];
+        line[0] = '\0';
+        for (int i=0;i<n;i++) strcat(line, i ? " | true" : "true");
+        long rounds = iters / 4 > 10 ? iters / 4 : 10;
+        for (long it = 0; it < rounds; it++) {
+            Node *n;
+            long long t0 = now_ns();
+            parse_line(&a, line, &n, false);
+            exec_node(&a, n);
+            t[it] = now_ns() - t0;
+            arena_reset(&a);
+        }
+        emit("pipeline_run", kind == LAUNCH_SPAWN ? "spawn" : "fork", n, t, rounds);
+    }
+    free(t);
+}
+
+// ---------- coprocess round trip ----------
+// One request line through `coreq` to a coprocess `cat`, next to the
+// pipeline_run figures for a fresh process per call.
+static void bench_coproc() {
+    char *start[] = { "coproc", "-n", "BENCH", "cat", NULL };
+    if (builtin_coproc(start) < 0) return;
+    long rounds = iters * 10;
+    long long *t = malloc(sizeof(long long) * (size_t)rounds);
+    char *req[] = { "coreq", "-v", "BENCH_REPLY", "BENCH", "request", NULL };
+    for (long it = 0; it < rounds; it++) {
+        long long t0 = now_ns();
+        builtin_coreq(req);
+        t[it] = now_ns() - t0;
+    }
+    emit("coproc_roundtrip", "socketpair", 1, t, rounds);
+    free(t);
+    char *stop[] = { "coproc", "-c", "BENCH", NULL };
+    builtin_coproc(stop);
+}
+
+// ---------- parse and dispatch ----------
+static void bench_parse() {
+    static const char *lines[] = {
+        "ls -la /tmp",
+        "grep -n \"foo bar\" src/*.c | sort -k2 | uniq -c > counts.txt",
+        "echo 'single quoted | not a pipe' \"and $HOME\" esc\\ aped &",
+    };
+    Arena a = { 0 };
+    long reps = 200000;
+    long long samples[3];
+    for (int k=0;k<3;k++) {
+        long long t0 = now_ns();
+        for (long i=0;i<reps;i++) {
+            Node *n;
+            parse_line(&a, lines[k], &n, false);
+            arena_reset(&a);
+        }
+        samples[k] = (now_ns() - t0) / reps;
+    }
+    emit("parse_line", "per_line", reps, samples, 3);
+}
+
+static void bench_dispatch() {
+    static const char *names[] = { "cd", "jobs", "history", "hash", "ls", "grep", "kill", "make" };
+    long reps = 4000000;
+    volatile int hits = 0;
+    long long t0 = now_ns();
+    for (long i=0;i<reps;i++) if (find_builtin(names[i & 7])) hits++;
+    long long per = (now_ns() - t0) / (reps / 1000);   // per 1000 lookups
+    emit_once("builtin_lookup_x1000", "perfect_hash", reps, per);
+}
+
+// ---------- history ----------
+static void history_reset() {
+    for (unsigned long q = hist_first; q < hist_next; q++)
+        if (hist_owned(hist_at(q))) free((char *)hist_at(q)->s);
+    free(hist); hist = NULL; hist_alloc = 0;
+    hist_first = hist_next = 1;
+    if (hist_map) munmap((void *)hist_map, hist_map_len);
+    hist_map = NULL; hist_map_len = 0;
+    if (hist_fd >= 0) close(hist_fd);
+    hist_fd = -1;
+    hist_file_bytes = hist_live_bytes = 0;
+    hist_index_drop();
+}
+
+static void bench_history(const char *dir) {
+    static const char *words[] = { "git", "grep", "make", "ls", "docker", "ssh", "vim", "awk" };
+    var_set("HOME", dir, true);
+    for (long n = 10000; n <= 1000000; n *= 10) {
+        FILE *f = fopen(history_path(), "w");
+        if (!f) { perror("history file"); return; }
+        unsigned seed = 1;
+        for (long i=0;i<n;i++) {
+            seed = seed * 1103515245u + 12345u;
+            fprintf(f, "%s %s --id=%ld\n", words[seed >> 29], words[(seed >> 26) & 7], i);
+        }
+        fclose(f);
+
+        char hs[32];
+        snprintf(hs, sizeof(hs), "%ld", n);
+        var_set("HISTSIZE", hs, false);
+        history_reset();
+        long long t0 = now_ns();
+        load_history();
+        emit_once("history_load", "mmap_tail", n, now_ns() - t0);
+
+        size_t nm;
+        t0 = now_ns();
+        free(hist_search("--id=4242", &nm));
+        emit_once("history_search_first", "trigram_build", n, now_ns() - t0);
+        long long s[50];
+        for (int i=0;i<50;i++) {
+            char pat[32];
+            snprintf(pat, sizeof(pat), "id=%ld", (long)i * 7919 % n);
+            t0 = now_ns();
+            free(hist_search(pat, &nm));
+            s[i] = now_ns() - t0;
+        }
+        emit("history_search", "trigram", n, s, 50);
+    }
+    history_reset();
+    unlink(history_path());
+}
+
+// ---------- job table ----------
+static void bench_jobs() {
+    for (int n = 100; n <= 100000; n *= 10) {
+        Job **js = malloc(sizeof(Job *) * (size_t)n);
+        char *names[1] = { "worker" };
+        long long t0 = now_ns();
+        for (int i=0;i<n;i++) {
+            pid_t pid = 4000000 + i;   // beyond pid_max: never a real child
+            char *hashed[1] = { NULL };
+            js[i] = job_create(pid, "worker --task", &pid, hashed, names, 1);
+            job_assign_id(js[i]);
+        }
+        long long create = (now_ns() - t0) / n;
+        t0 = now_ns();
+        volatile int found = 0;
+        for (int i=0;i<n;i++) {
+            if (intmap_get(&jobs_by_pid, 4000000 + i)) found++;
+            if (find_job_by_id(js[i]->id)) found++;
+        }
+        long long lookup = (now_ns() - t0) / (2L * n);
+        t0 = now_ns();
+        for (int i=0;i<n;i++) job_remove(js[i]);
+        long long rm = (now_ns() - t0) / n;
+        emit_once("job_create", "per_job", n, create);
+        emit_once("job_lookup", "per_lookup", n, lookup);
+        emit_once("job_remove", "per_job", n, rm);
+        free(js);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--probe") == 0) {
+        long long t = now_ns();
+        return write(STDOUT_FILENO, &t, sizeof(t)) == sizeof(t) ? 0 : 1;
+    }
+    long ballast_mb = 0;
+    for (int i=1;i<argc;i++) {
+        if (strcmp(argv[i], "--iters") == 0 && i+1 < argc) iters = atol(argv[++i]);
+        else if (strcmp(argv[i], "--ballast") == 0 && i+1 < argc) ballast_mb = atol(argv[++i]);
+        else { fprintf(stderr, "usage: shellbench [--iters N] [--ballast MB]\n"); return 2; }
+    }
+    if (iters < 10) iters = 10;
+    if (ballast_mb > 0) {
+        size_t len = (size_t)ballast_mb << 20;
+        char *b = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (b == MAP_FAILED) { perror("ballast"); return 1; }
+        for (size_t off = 0; off < len; off += 4096) b[off] = 1;
+    }
+
+    vars_init(argv, 1);
+    install_signal_handlers();
+    builtins_init();
+
+    // Run the probe by name through a longish PATH, as on the hosts the
+    // hash was written for; the bench's own directory comes last.
+    char self[4096], dir[4096], path[8192];
+    ssize_t n = readlink("/proc/self/exe", self, sizeof(self)-1);
+    if (n <= 0) { perror("readlink"); return 1; }
+    self[n] = '\0';
+    char *slash = strrchr(self, '/');
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - self), self);
+    snprintf(path, sizeof(path), "/nonexistent/a:/nonexistent/b:/nonexistent/c:/nonexistent/d:"
+             "/nonexistent/e:/nonexistent/f:/nonexistent/g:/nonexistent/h:/nonexistent/i:"
+             "/nonexistent/j:/nonexistent/k:%s:/usr/bin:/bin", dir);
+    var_set("PATH", path, true);
+
+    char tmpdir[] = "/tmp/shellbench.XXXXXX";
+    if (!mkdtemp(tmpdir)) { perror("mkdtemp"); return 1; }
+
+    printf("{\n  \"ballast_mb\": %ld,\n  \"iters\": %ld,\n  \"results\": [", ballast_mb, iters);
+    fprintf(stderr, "launch latency...\n");
+    bench_launch(slash + 1, LAUNCH_FORK, false);
+    bench_launch(slash + 1, LAUNCH_FORK, true);
+    bench_launch(slash + 1, LAUNCH_SPAWN, false);
+    bench_launch(slash + 1, LAUNCH_SPAWN, true);
+    fprintf(stderr, "pipelines...\n");
+    bench_pipeline(LAUNCH_FORK);
+    bench_pipeline(LAUNCH_SPAWN);
+    fprintf(stderr, "coprocess...\n");
+    bench_coproc();
+    fprintf(stderr, "parse and dispatch...\n");
+    bench_parse();
+    bench_dispatch();
+    fprintf(stderr, "history...\n");
+    bench_history(tmpdir);
+    fprintf(stderr, "job table...\n");
+    bench_jobs();
+    printf("\n  ]\n}\n");
+    rmdir(tmpdir);
+    return 0;
+}
@@ -11,431 +11,5647 @@
 #include <signal.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <limits.h>
 #include <ctype.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <pwd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <dirent.h>
+#include <stdarg.h>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#endif
 
-#define MAX_INPUT   2048
-#define MAX_ARGS    128
-#define MAX_CMDS    32         // max piped segments
-#define MAX_JOBS    64
-#define MAX_HISTORY 200
+#define MAX_HISTORY 10000      // default HISTSIZE
+
+// Descriptors 0-9 can be redirected; the shell keeps its own at 10 and up,
+// all close-on-exec, so neither N>&M nor a command can reach them.
+#define REDIR_FDS 10
 
 typedef enum { JOB_RUNNING=0, JOB_STOPPED=1, JOB_DONE=2 } job_state;
 
 typedef struct {
-    int   id;                  // 1-based job id
+    pid_t pid;
+    job_state state;
+    int   status;              // wait status once done
+    char *hashed;              // name resolved through the command hash, or NULL
+    const char *name;          // interned argv[0], for per-stage reports
+    struct rusage ru;          // from wait4() once the process has exited
+} JobProc;
+
+typedef struct Job {
+    int   id;                  // 1-based job id, 0 while in the foreground
     pid_t pgid;                // process group id (pipeline group)
-    char  cmdline[MAX_INPUT];
+    const char *cmdline;       // interned
     job_state state;
+    JobProc *procs;            // one per pipeline stage
+    int   nprocs;
+    int   nalive;              // procs not yet done
+    struct timespec started, finished;   // CLOCK_MONOTONIC
+    struct rusage ru;          // summed over exited procs, ru_maxrss is the max
+    bool  timed;               // `time` keyword: report resources when done
+    char *cgroup;              // its own cgroup v2 leaf, or NULL
+    struct Job *prev, *next;   // all jobs, in launch order
 } Job;
 
-static Job jobs[MAX_JOBS];
-static int  job_count = 0;
-static int  next_job_id = 1;
+static bool interactive = false;   // prompt, history, line-at-a-time input
+static bool job_control = false;   // interactive on a terminal: pgids and tcsetpgrp
+
+// Move a descriptor the shell keeps to REDIR_FDS or above; fd itself if
+// that fails.
+static int shell_fd(int fd) {
+    if (fd < 0 || fd >= REDIR_FDS) return fd;
+    int hi = fcntl(fd, F_DUPFD_CLOEXEC, REDIR_FDS);
+    if (hi < 0) return fd;
+    close(fd);
+    return hi;
+}
+
+// ---------- variables ----------
+// Shell variables live in one table; exported ones also hold a slot in
+// shell_envp, which is environ. That array is kept up to date in place as
+// variables change, a new value being one pointer store, so there is
+// nothing to build per launch: forked children inherit it and
+// posix_spawn is handed it as is.
+typedef struct {
+    char *name;
+    char *kv;        // "NAME=value", NULL while unset
+    int   env_idx;   // slot in shell_envp, -1 if not in the environment
+    bool  exported;
+} Var;
+
+static Var    *vars = NULL;
+static size_t  vars_cap = 0, vars_len = 0;   // power of two
+static char  **shell_envp = NULL;           // NULL-terminated
+static size_t  nenv = 0, env_cap = 0;
+static char  **pos_args = NULL;             // $0, $1, ...
+static int     npos_args = 0;               // including $0
+static pid_t   shell_pid;                   // $$
+static int     last_status = 0;             // $?, of the last pipeline
+static int     subst_status = 0;            // of the last $(...), for a bare assignment
 
-static char *history[MAX_HISTORY];
-static int   history_len = 0;
+static void var_changed(const char *name);  // the shell's own reactions
 
-// ---------- helpers ----------
-static void trim(char *s) {
-    // trim leading/trailing spaces
-    int n = (int)strlen(s);
-    int i = 0; while (isspace((unsigned char)s[i])) i++;
-    int j = n-1; while (j>=i && isspace((unsigned char)s[j])) j--;
-    int len = j-i+1;
-    if (len < 0) len = 0;
-    memmove(s, s+i, len);
-    s[len] = '\0';
+static unsigned long str_hash_n(const char *s, size_t n) {
+    unsigned long h = 1469598103934665603UL;   // FNV-1a
+    for (size_t i=0;i<n;i++) { h ^= (unsigned char)s[i]; h *= 1099511628211UL; }
+    return h;
 }
 
-static void add_history(const char *line) {
-    if (!line || !*line) return;
-    if (history_len == MAX_HISTORY) {
-        free(history[0]);
-        memmove(&history[0], &history[1], sizeof(char*)*(MAX_HISTORY-1));
-        history_len--;
+static unsigned long str_hash(const char *s) { return str_hash_n(s, strlen(s)); }
+
+// Length of the NAME at the start of s, 0 if it doesn't start with one.
+static size_t name_len(const char *s) {
+    if (!(isalpha((unsigned char)*s) || *s == '_')) return 0;
+    size_t n = 1;
+    while (isalnum((unsigned char)s[n]) || s[n] == '_') n++;
+    return n;
+}
+
+static size_t var_slot(const char *name, size_t n) {
+    size_t i = str_hash_n(name, n) & (vars_cap-1);
+    while (vars[i].name && !(strncmp(vars[i].name, name, n) == 0 && !vars[i].name[n])) i = (i+1) & (vars_cap-1);
+    return i;
+}
+
+static Var *var_find(const char *name, size_t n) {
+    if (!vars_cap) return NULL;
+    Var *v = &vars[var_slot(name, n)];
+    return v->name ? v : NULL;
+}
+
+static Var *var_intern(const char *name) {
+    size_t n = strlen(name);
+    if ((vars_len+1)*2 > vars_cap) {
+        Var *old = vars; size_t oldcap = vars_cap;
+        vars_cap = oldcap ? oldcap*2 : 128;
+        vars = calloc(vars_cap, sizeof(Var));
+        for (size_t i=0;i<oldcap;i++)
+            if (old[i].name) vars[var_slot(old[i].name, strlen(old[i].name))] = old[i];
+        free(old);
+    }
+    Var *v = &vars[var_slot(name, n)];
+    if (!v->name) {
+        *v = (Var){ .name = strdup(name), .env_idx = -1 };
+        vars_len++;
+    }
+    return v;
+}
+
+static const char *var_get(const char *name) {
+    size_t n = strlen(name);
+    Var *v = var_find(name, n);
+    return v && v->kv ? v->kv + n + 1 : NULL;
+}
+
+static void env_put(Var *v) {
+    if (v->env_idx < 0) {
+        if (nenv + 2 > env_cap) {
+            env_cap = env_cap ? env_cap*2 : 64;
+            shell_envp = realloc(shell_envp, sizeof(char *) * env_cap);
+            environ = shell_envp;
+        }
+        v->env_idx = (int)nenv++;
+        shell_envp[nenv] = NULL;
+    }
+    shell_envp[v->env_idx] = v->kv;
+}
+
+static void env_drop(Var *v) {
+    if (v->env_idx < 0) return;
+    size_t last = --nenv;
+    if ((size_t)v->env_idx != last) {   // the last entry fills the hole
+        char *kv = shell_envp[last];
+        shell_envp[v->env_idx] = kv;
+        var_find(kv, strcspn(kv, "="))->env_idx = v->env_idx;
+    }
+    shell_envp[nenv] = NULL;
+    v->env_idx = -1;
+}
+
+// Set name to value; export makes it part of the environment, otherwise
+// it stays exported or not as it was.
+static void var_set(const char *name, const char *value, bool export) {
+    Var *v = var_intern(name);
+    size_t nl = strlen(name), vl = strlen(value);
+    char *kv = malloc(nl + vl + 2);
+    memcpy(kv, name, nl);
+    kv[nl] = '=';
+    memcpy(kv + nl + 1, value, vl + 1);
+    free(v->kv);
+    v->kv = kv;
+    if (export) v->exported = true;
+    if (v->exported) env_put(v);
+    var_changed(name);
+}
+
+static void var_unset(const char *name) {
+    Var *v = var_find(name, strlen(name));
+    if (!v || !v->kv) return;
+    env_drop(v);
+    free(v->kv);
+    v->kv = NULL;
+    v->exported = false;
+    var_changed(name);
+}
+
+static void var_export(const char *name) {
+    Var *v = var_intern(name);
+    v->exported = true;
+    if (v->kv) env_put(v);
+}
+
+// Take over the environment we were started with.
+static void vars_init(char **args, int nargs) {
+    shell_pid = getpid();
+    pos_args = args;
+    npos_args = nargs;
+    char **env = environ, name[256];
+    for (char **e = env; *e; e++) {
+        size_t n = strcspn(*e, "=");
+        if (!(*e)[n] || n >= sizeof(name)) continue;
+        memcpy(name, *e, n);
+        name[n] = '\0';
+        var_set(name, *e + n + 1, true);
+    }
+    if (!shell_envp) {   // started with nothing: still an environ of our own
+        env_cap = 64;
+        shell_envp = calloc(env_cap, sizeof(char *));
+        environ = shell_envp;
+    }
+}
+
+// export [NAME[=value]...]; with no names, list the environment.
+static int builtin_export(char **argv) {
+    if (!argv[1]) {
+        for (size_t i=0;i<nenv;i++) {
+            const char *kv = shell_envp[i], *eq = strchr(kv, '=');
+            printf("export %.*s='", (int)(eq - kv), kv);
+            for (const char *c = eq + 1; *c; c++) {
+                if (*c == '\'') fputs("'\\''", stdout);
+                else putchar(*c);
+            }
+            puts("'");
+        }
+        return 0;
+    }
+    int rc = 0;
+    for (int i=1;argv[i];i++) {
+        size_t n = name_len(argv[i]);
+        if (!n || (argv[i][n] && argv[i][n] != '=') || n >= 256) {
+            fprintf(stderr, "export: `%s': not a valid identifier\n", argv[i]);
+            rc = -1;
+            continue;
+        }
+        char name[256];
+        memcpy(name, argv[i], n);
+        name[n] = '\0';
+        if (argv[i][n] == '=') var_set(name, argv[i] + n + 1, true);
+        else var_export(name);
+    }
+    return rc;
+}
+
+static int builtin_unset(char **argv) {
+    for (int i=1;argv[i];i++) var_unset(argv[i]);
+    return 0;
+}
+
+// ---------- history ----------
+// In memory: a ring of the last HISTSIZE lines, numbered by a sequence that
+// only grows. On disk: an append-only log, one write per command, so a
+// crash loses nothing and concurrent shells interleave instead of
+// clobbering each other. Startup maps the log and indexes only its tail;
+// loaded lines point straight into the mapping.
+typedef struct {
+    const char *s;     // not NUL-terminated when it points into the map
+    unsigned    len;
+} HistEntry;
+
+static HistEntry    *hist = NULL;
+static size_t        hist_alloc = 0;         // ring slots, grows up to hist_size
+static size_t        hist_size = MAX_HISTORY;
+static unsigned long hist_first = 1, hist_next = 1;   // retained seqs [first, next)
+static const char   *hist_map = NULL;        // the log as mapped at startup
+static size_t        hist_map_len = 0;
+static int           hist_fd = -1;           // O_APPEND log
+static size_t        hist_file_bytes = 0;    // log size as far as we know
+static size_t        hist_live_bytes = 0;    // bytes of it still in the ring
+static size_t        hist_compacted_bytes = 0;   // log size when we last compacted
+
+#define HIST_COMPACT_SLACK 65536   // don't rewrite the log for less than this
+
+static HistEntry *hist_at(unsigned long seq) {
+    return &hist[seq % hist_alloc];
+}
+
+static bool hist_owned(const HistEntry *e) {
+    return !(hist_map && e->s >= hist_map && e->s < hist_map + hist_map_len);
+}
+
+static void hist_push(const char *s, unsigned len) {
+    if (hist_next - hist_first == hist_size) {
+        HistEntry *old = hist_at(hist_first++);
+        if (hist_owned(old)) free((char *)old->s);
+        hist_live_bytes -= old->len + 1;
+    } else if (hist_next - hist_first == hist_alloc) {
+        size_t cap = hist_alloc ? hist_alloc*2 : 256;
+        if (cap > hist_size) cap = hist_size;
+        HistEntry *ring = malloc(cap * sizeof(HistEntry));
+        for (unsigned long q = hist_first; q < hist_next; q++) ring[q % cap] = *hist_at(q);
+        free(hist);
+        hist = ring; hist_alloc = cap;
     }
-    history[history_len++] = strdup(line);
+    HistEntry *e = hist_at(hist_next++);
+    e->s = s; e->len = len;
+    hist_live_bytes += len + 1;
 }
 
 static const char* history_path() {
     static char path[1024];
-    const char *home = getenv("HOME");
+    const char *home = var_get("HOME");
     if (!home) home = ".";
     snprintf(path, sizeof(path), "%s/.myshell_history", home);
     return path;
 }
 
-static void load_history() {
-    FILE *f = fopen(history_path(), "r");
-    if (!f) return;
-    char *line = NULL; size_t cap = 0;
-    while (getline(&line, &cap, f) != -1) {
-        line[strcspn(line, "\n")] = 0;
-        add_history(line);
-    }
-    free(line);
-    fclose(f);
+// The log holds an entry per line, except that a multi-line command is
+// written a line at a time with a backslash before each inner newline.
+// Backslashes a line really ends with are written doubled, so an odd run
+// marks a continued entry; nearly every line has none and is logged, and
+// mapped back, as is.
+static size_t hist_backslashes(const char *m, size_t eol) {
+    size_t k = 0;
+    while (k < eol && m[eol-1-k] == '\\') k++;
+    return k;
 }
 
-static void save_history() {
-    FILE *f = fopen(history_path(), "w");
-    if (!f) return;
-    for (int i=0;i<history_len;i++) fprintf(f, "%s\n", history[i]);
-    fclose(f);
+// Where the last hist_size entries of the log m start.
+static size_t hist_tail(const char *m, size_t size) {
+    size_t start = size, entries = 0;
+    if (m[start-1] == '\n') start--;
+    while (start > 0 && entries < hist_size) {
+        const char *nl = memrchr(m, '\n', start);
+        start = nl ? (size_t)(nl - m) : 0;
+        if (!(start > 0 && hist_backslashes(m, start) % 2)) entries++;
+    }
+    return start > 0 ? start + 1 : 0;   // past the newline before the tail
 }
 
-// ---------- job table ----------
-static int find_job_index_by_id(int id) {
-    for (int i=0;i<job_count;i++) if (jobs[i].id == id) return i;
-    return -1;
+// Rewrite the log keeping only its last hist_size entries. Works from the
+// file as it is now, not from our ring, so lines other shells appended
+// survive; the exclusive flock keeps two shells from compacting at once,
+// and appenders out until the new file is in place.
+static void compact_history() {
+    const char *path = history_path();
+    hist_compacted_bytes = hist_file_bytes;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) { close(fd); return; }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) { close(fd); return; }
+    size_t size = (size_t)st.st_size;
+    char *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) { close(fd); return; }
+
+    size_t start = hist_tail(m, size);
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (out >= 0) {
+        size_t off = start;
+        while (off < size) {
+            ssize_t n = write(out, m + off, size - off);
+            if (n <= 0) break;
+            off += (size_t)n;
+        }
+        close(out);
+        if (off == size && rename(tmp, path) == 0) hist_file_bytes = hist_compacted_bytes = size - start;
+        else unlink(tmp);
+    }
+    munmap(m, size);
+    close(fd);
+    // our own append fd now points at the replaced file
+    if (hist_fd >= 0) {
+        close(hist_fd);
+        hist_fd = shell_fd(open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600));
+    }
 }
 
-static int find_job_index_by_pgid(pid_t pgid) {
-    for (int i=0;i<job_count;i++) if (jobs[i].pgid == pgid) return i;
-    return -1;
+// Compact once the log is mostly lines the ring has dropped, and has grown
+// by the slack since the last try: lines other shells keep in it can hold
+// it over twice our share for good, and a try that couldn't shrink it
+// shouldn't be repeated on every line.
+static void hist_maybe_compact() {
+    if (hist_file_bytes > 2*hist_live_bytes + HIST_COMPACT_SLACK &&
+        hist_file_bytes > hist_compacted_bytes + HIST_COMPACT_SLACK)
+        compact_history();
 }
 
-static void print_jobs() {
-    for (int i=0;i<job_count;i++) {
-        if (jobs[i].state == JOB_DONE) continue; // optional: hide done
-        const char *st = jobs[i].state==JOB_RUNNING ? "Running" :
-                         jobs[i].state==JOB_STOPPED ? "Stopped" : "Done";
-        printf("[%d] %d  %-8s  %s\n", jobs[i].id, jobs[i].pgid, st, jobs[i].cmdline);
+static void load_history() {
+    const char *h = var_get("HISTSIZE");
+    if (h && strtoul(h, NULL, 10) > 0) hist_size = strtoul(h, NULL, 10);
+
+    const char *path = history_path();
+    hist_fd = shell_fd(open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) { close(fd); return; }
+    size_t size = (size_t)st.st_size;
+    char *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return;
+    hist_map = m; hist_map_len = size;
+    hist_file_bytes = size;
+
+    // index the last hist_size entries; most point into the map, one
+    // with escaped backslashes or several lines gets its own copy
+    char *entry = NULL;
+    size_t elen = 0;
+    for (size_t off = hist_tail(m, size); off < size; ) {
+        const char *nl = memchr(m + off, '\n', size - off);
+        size_t len = nl ? (size_t)(nl - (m + off)) : size - off;
+        size_t k = hist_backslashes(m, off + len);
+        if (!k && !entry) {
+            if (len) hist_push(m + off, (unsigned)len);
+            off += len + 1;
+            continue;
+        }
+        bool cont = k % 2 && off + len + 1 < size;
+        size_t keep = len - k + k/2;
+        entry = realloc(entry, elen + keep + 1);
+        memcpy(entry + elen, m + off, keep);
+        elen += keep;
+        if (cont) entry[elen++] = '\n';
+        else { entry[elen] = '\0'; hist_push(entry, (unsigned)elen); entry = NULL; elen = 0; }
+        off += len + 1;
     }
+    madvise(m, size, MADV_RANDOM);
+    hist_maybe_compact();
 }
 
-static void remove_done_jobs() {
-    int w = 0;
-    for (int r=0;r<job_count;r++) {
-        if (jobs[r].state != JOB_DONE) {
-            if (w != r) jobs[w] = jobs[r];
-            w++;
+// Add a command to the ring and append it to the log (skip duplicate
+// consecutive).
+static void add_history(const char *line) {
+    if (!line || !*line) return;
+    unsigned len = (unsigned)strlen(line);
+    if (hist_next > hist_first) {
+        const HistEntry *last = hist_at(hist_next-1);
+        if (last->len == len && memcmp(last->s, line, len) == 0) return;
+    }
+    hist_push(strdup(line), len);
+    if (hist_fd < 0) return;
+
+    // a shared lock holds off a compaction between its snapshot and the
+    // rename; if one finished while we waited, follow it to the new file
+    for (;;) {
+        if (flock(hist_fd, LOCK_SH) < 0 && errno == EINTR) continue;
+        struct stat st;
+        if (fstat(hist_fd, &st) < 0 || st.st_nlink > 0) break;
+        close(hist_fd);
+        hist_fd = shell_fd(open(history_path(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600));
+        if (hist_fd < 0) return;
+    }
+    // escaped as hist_backslashes() reads it back
+    char *esc = NULL;
+    size_t elen = len;
+    if (memchr(line, '\n', len) || line[len-1] == '\\') {
+        esc = malloc(2 * (size_t)len + 1);
+        elen = 0;
+        for (size_t i = 0; i < len; i++) {
+            if (line[i] == '\\' && strspn(line + i, "\\") == strcspn(line + i, "\n")) esc[elen++] = '\\';
+            if (line[i] == '\n') esc[elen++] = '\\';
+            esc[elen++] = line[i];
         }
     }
-    job_count = w;
+    struct iovec iov[2] = { { esc ? esc : (void *)line, elen }, { "\n", 1 } };
+    if (writev(hist_fd, iov, 2) > 0) hist_file_bytes += elen + 1;
+    flock(hist_fd, LOCK_UN);
+    free(esc);
+    hist_maybe_compact();
 }
 
-static void add_job_entry(pid_t pgid, const char *cmdline, job_state st) {
-    if (job_count >= MAX_JOBS) return;
-    jobs[job_count].id = next_job_id++;
-    jobs[job_count].pgid = pgid;
-    jobs[job_count].state = st;
-    strncpy(jobs[job_count].cmdline, cmdline, sizeof(jobs[job_count].cmdline)-1);
-    jobs[job_count].cmdline[sizeof(jobs[job_count].cmdline)-1] = '\0';
-    job_count++;
+// ---------- command hash ----------
+// PATH lookups are cached in the parent so children can execv() the
+// resolved binary directly instead of probing every PATH entry.
+typedef struct {
+    char *name;
+    char *path;
+    int   hits;
+} HashEntry;
+
+static HashEntry *cmd_hash = NULL;
+static size_t     cmd_hash_cap = 0;   // power of two
+static size_t     cmd_hash_len = 0;
+
+static const char *path_var() {
+    const char *p = var_get("PATH");
+    return p ? p : "/usr/local/bin:/usr/bin:/bin";
 }
 
-// ---------- signals ----------
-static void sigchld_handler(int sig) {
-    (void)sig;
-    int status;
-    pid_t pid;
-    // Reap all children; update job state
-    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
-        pid_t pg = getpgid(pid);
-        int idx = find_job_index_by_pgid(pg);
-        if (idx >= 0) {
-            if (WIFSTOPPED(status)) {
-                jobs[idx].state = JOB_STOPPED;
-            } else if (WIFCONTINUED(status)) {
-                jobs[idx].state = JOB_RUNNING;
-            } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
-                jobs[idx].state = JOB_DONE;
-            }
-        }
+static void hash_clear() {
+    for (size_t i=0;i<cmd_hash_cap;i++) {
+        free(cmd_hash[i].name); free(cmd_hash[i].path);
+        cmd_hash[i].name = cmd_hash[i].path = NULL;
     }
+    cmd_hash_len = 0;
 }
 
-static void install_signal_handlers() {
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = sigchld_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP | SA_NOCLDWAIT; // auto-reap zombies
-    sigaction(SIGCHLD, &sa, NULL);
+static size_t hash_slot(const char *name) {
+    size_t i = str_hash(name) & (cmd_hash_cap-1);
+    while (cmd_hash[i].name && strcmp(cmd_hash[i].name, name) != 0) i = (i+1) & (cmd_hash_cap-1);
+    return i;
+}
 
-    // Ignore Ctrl-C in shell; children will reset to default
-    signal(SIGINT, SIG_IGN);
-    signal(SIGTSTP, SIG_IGN);
+static void hash_grow() {
+    HashEntry *old = cmd_hash; size_t oldcap = cmd_hash_cap;
+    cmd_hash_cap = oldcap ? oldcap*2 : 64;
+    cmd_hash = calloc(cmd_hash_cap, sizeof(HashEntry));
+    for (size_t i=0;i<oldcap;i++) if (old[i].name) cmd_hash[hash_slot(old[i].name)] = old[i];
+    free(old);
 }
 
-// ---------- parsing ----------
-typedef struct {
-    char *argv[MAX_ARGS];
-    char *infile;    // for '<'
-    char *outfile;   // for '>' or '>>'
-    int   append;    // 0:>, 1:>>
-} Command;
+// The cached path for name, or NULL; no PATH search, no hit counted.
+static const char *hash_cached(const char *name) {
+    if (!cmd_hash_len) return NULL;
+    size_t i = hash_slot(name);
+    return cmd_hash[i].name ? cmd_hash[i].path : NULL;
+}
 
-// split pipeline into segments by '|'
-static int split_pipeline(char *line, char *segments[], int maxseg) {
-    int n = 0;
-    char *saveptr = NULL;
-    char *tok = strtok_r(line, "|", &saveptr);
-    while (tok && n < maxseg) {
-        while (*tok==' ') tok++;
-        segments[n++] = tok;
-        tok = strtok_r(NULL, "|", &saveptr);
+static void hash_forget(const char *name) {
+    if (!cmd_hash_len) return;
+    size_t i = hash_slot(name);
+    if (!cmd_hash[i].name) return;
+    free(cmd_hash[i].name); free(cmd_hash[i].path);
+    cmd_hash[i].name = cmd_hash[i].path = NULL;
+    cmd_hash_len--;
+    // backward-shift the rest of the probe run so lookups never see a hole
+    size_t j = i;
+    for (;;) {
+        j = (j+1) & (cmd_hash_cap-1);
+        if (!cmd_hash[j].name) break;
+        size_t home = str_hash(cmd_hash[j].name) & (cmd_hash_cap-1);
+        if (((j - home) & (cmd_hash_cap-1)) >= ((j - i) & (cmd_hash_cap-1))) {
+            cmd_hash[i] = cmd_hash[j];
+            cmd_hash[j].name = cmd_hash[j].path = NULL;
+            i = j;
+        }
     }
-    return n;
 }
 
-static void parse_command(char *segment, Command *cmd) {
-    memset(cmd, 0, sizeof(*cmd));
-    int argc = 0;
-    char *saveptr = NULL;
-    char *tok = strtok_r(segment, " \t\n", &saveptr);
-    while (tok && argc < MAX_ARGS-1) {
-        if (strcmp(tok, "<") == 0) {
-            tok = strtok_r(NULL, " \t\n", &saveptr);
-            if (tok) cmd->infile = tok;
-        } else if (strcmp(tok, ">") == 0) {
-            tok = strtok_r(NULL, " \t\n", &saveptr);
-            if (tok) { cmd->outfile = tok; cmd->append = 0; }
-        } else if (strcmp(tok, ">>") == 0) {
-            tok = strtok_r(NULL, " \t\n", &saveptr);
-            if (tok) { cmd->outfile = tok; cmd->append = 1; }
-        } else {
-            cmd->argv[argc++] = tok;
-        }
-        tok = strtok_r(NULL, " \t\n", &saveptr);
+static char *search_path(const char *name) {
+    const char *p = path_var();
+    char buf[4096];
+    for (;;) {
+        const char *end = strchrnul(p, ':');
+        int dlen = (int)(end - p);
+        if (dlen == 0) snprintf(buf, sizeof(buf), "%s", name);   // empty entry means cwd
+        else snprintf(buf, sizeof(buf), "%.*s/%s", dlen, p, name);
+        struct stat st;
+        if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) && access(buf, X_OK) == 0) return strdup(buf);
+        if (!*end) return NULL;
+        p = end+1;
     }
-    cmd->argv[argc] = NULL;
 }
 
-// ---------- execution ----------
-static int builtin_cd(char **argv) {
-    const char *target = argv[1] ? argv[1] : getenv("HOME");
-    if (!target) target = ".";
-    if (chdir(target) != 0) perror("cd");
-    return 0;
+// Resolve a command name through the hash. Returns NULL for names with a
+// slash (used as-is) and for commands not found on PATH.
+static const char *hash_lookup(const char *name) {
+    if (!name || !*name || strchr(name, '/')) return NULL;
+    if (cmd_hash_cap) {
+        size_t i = hash_slot(name);
+        if (cmd_hash[i].name) { cmd_hash[i].hits++; return cmd_hash[i].path; }
+    }
+    char *path = search_path(name);
+    if (!path) return NULL;
+    if ((cmd_hash_len+1)*2 > cmd_hash_cap) hash_grow();
+    size_t i = hash_slot(name);
+    cmd_hash[i].name = strdup(name);
+    cmd_hash[i].path = path;
+    cmd_hash[i].hits = 1;
+    cmd_hash_len++;
+    return path;
 }
 
-static void print_pwd() {
-    char buf[4096];
-    if (getcwd(buf, sizeof(buf))) puts(buf);
-    else perror("pwd");
-}
-
-static bool is_builtin(const Command *cmd) {
-    if (!cmd->argv[0]) return true;
-    return strcmp(cmd->argv[0], "cd")==0 ||
-           strcmp(cmd->argv[0], "pwd")==0 ||
-           strcmp(cmd->argv[0], "exit")==0 ||
-           strcmp(cmd->argv[0], "jobs")==0 ||
-           strcmp(cmd->argv[0], "fg")==0   ||
-           strcmp(cmd->argv[0], "bg")==0   ||
-           strcmp(cmd->argv[0], "kill")==0 ||
-           strcmp(cmd->argv[0], "history")==0;
-}
-
-static int run_builtin(Command *cmd, const char *full_line) {
-    (void)full_line;
-    char **argv = cmd->argv;
-    if (!argv[0]) return 0;
-    if (strcmp(argv[0], "cd")==0)          return builtin_cd(argv);
-    if (strcmp(argv[0], "pwd")==0)         { print_pwd(); return 0; }
-    if (strcmp(argv[0], "exit")==0)        { save_history(); exit(0); }
-    if (strcmp(argv[0], "jobs")==0)        { remove_done_jobs(); print_jobs(); return 0; }
-    if (strcmp(argv[0], "history")==0)     { for (int i=0;i<history_len;i++) printf("%d  %s\n", i+1, history[i]); return 0; }
-
-    if (strcmp(argv[0], "fg")==0) {
-        if (!argv[1]) { fprintf(stderr, "fg <job_id>\n"); return -1; }
-        int id = atoi(argv[1]);
-        int idx = find_job_index_by_id(id);
-        if (idx<0) { fprintf(stderr, "fg: no such job\n"); return -1; }
-        pid_t pgid = jobs[idx].pgid;
-        // Give terminal to job, continue, wait, restore
-        tcsetpgrp(STDIN_FILENO, pgid);
-        kill(-pgid, SIGCONT);
-        int status;
-        while (waitpid(-pgid, &status, WUNTRACED) > 0) {
-            if (WIFSTOPPED(status)) { jobs[idx].state = JOB_STOPPED; break; }
-        }
-        tcsetpgrp(STDIN_FILENO, getpgrp());
-        if (kill(-pgid, 0) == -1 && errno == ESRCH) jobs[idx].state = JOB_DONE;
+static void compl_forget();
+
+static int builtin_hash(char **argv) {
+    if (!argv[1]) {
+        if (!cmd_hash_len) { puts("hash: hash table empty"); return 0; }
+        puts("hits\tcommand");
+        for (size_t i=0;i<cmd_hash_cap;i++)
+            if (cmd_hash[i].name) printf("%4d\t%s\n", cmd_hash[i].hits, cmd_hash[i].path);
         return 0;
     }
-
-    if (strcmp(argv[0], "bg")==0) {
-        if (!argv[1]) { fprintf(stderr, "bg <job_id>\n"); return -1; }
-        int id = atoi(argv[1]);
-        int idx = find_job_index_by_id(id);
-        if (idx<0) { fprintf(stderr, "bg: no such job\n"); return -1; }
-        kill(-jobs[idx].pgid, SIGCONT);
-        jobs[idx].state = JOB_RUNNING;
+    if (strcmp(argv[1], "-r")==0) { hash_clear(); compl_forget(); return 0; }
+    int rc = 0;
+    if (strcmp(argv[1], "-d")==0) {
+        for (int i=2;argv[i];i++) hash_forget(argv[i]);
         return 0;
     }
+    for (int i=1;argv[i];i++) {
+        hash_forget(argv[i]);   // re-resolve explicitly named commands
+        const char *path = hash_lookup(argv[i]);
+        if (!path && !strchr(argv[i], '/')) { fprintf(stderr, "hash: %s: not found\n", argv[i]); rc = -1; }
+        else if (path) { size_t k = hash_slot(argv[i]); cmd_hash[k].hits = 0; }
+    }
+    return rc;
+}
 
-    if (strcmp(argv[0], "kill")==0) {
-        if (!argv[1]) { fprintf(stderr, "kill <job_id>\n"); return -1; }
-        int id = atoi(argv[1]);
-        int idx = find_job_index_by_id(id);
-        if (idx<0) { fprintf(stderr, "kill: no such job\n"); return -1; }
-        if (kill(-jobs[idx].pgid, SIGTERM) == -1) perror("kill");
-        jobs[idx].state = JOB_DONE;
-        return 0;
+// ---------- int map ----------
+// Open-addressing map from positive int keys (pids, job ids) to pointers.
+typedef struct { int key; void *val; } IntSlot;
+typedef struct { IntSlot *slots; size_t cap, len; } IntMap;
+
+static size_t intmap_home(const IntMap *m, int key) {
+    return ((unsigned)key * 2654435761u) & (m->cap-1);
+}
+
+static void *intmap_get(const IntMap *m, int key) {
+    if (!m->len) return NULL;
+    for (size_t i = intmap_home(m, key);; i = (i+1) & (m->cap-1)) {
+        if (m->slots[i].key == key) return m->slots[i].val;
+        if (!m->slots[i].key) return NULL;
     }
+}
 
-    return -1;
+static void intmap_put(IntMap *m, int key, void *val) {
+    if ((m->len+1)*2 > m->cap) {
+        IntSlot *old = m->slots; size_t oldcap = m->cap;
+        m->cap = oldcap ? oldcap*2 : 16;
+        m->slots = calloc(m->cap, sizeof(IntSlot));
+        m->len = 0;
+        for (size_t i=0;i<oldcap;i++) if (old[i].key) intmap_put(m, old[i].key, old[i].val);
+        free(old);
+    }
+    size_t i = intmap_home(m, key);
+    while (m->slots[i].key && m->slots[i].key != key) i = (i+1) & (m->cap-1);
+    if (!m->slots[i].key) m->len++;
+    m->slots[i].key = key;
+    m->slots[i].val = val;
 }
 
-static void setup_redirections(const Command *cmd) {
-    if (cmd->infile) {
-        int fd = open(cmd->infile, O_RDONLY);
-        if (fd < 0) { perror("open <"); _exit(1); }
-        dup2(fd, STDIN_FILENO);
-        close(fd);
+static void intmap_del(IntMap *m, int key) {
+    if (!m->len) return;
+    size_t i = intmap_home(m, key);
+    while (m->slots[i].key != key) {
+        if (!m->slots[i].key) return;
+        i = (i+1) & (m->cap-1);
     }
-    if (cmd->outfile) {
-        int flags = O_WRONLY | O_CREAT | (cmd->append ? O_APPEND : O_TRUNC);
-        int fd = open(cmd->outfile, flags, 0644);
-        if (fd < 0) { perror("open >"); _exit(1); }
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
+    m->slots[i].key = 0;
+    m->len--;
+    // backward-shift the rest of the probe run so lookups never see a hole
+    for (size_t j = (i+1) & (m->cap-1); m->slots[j].key; j = (j+1) & (m->cap-1)) {
+        size_t home = intmap_home(m, m->slots[j].key);
+        if (((j - home) & (m->cap-1)) >= ((j - i) & (m->cap-1))) {
+            m->slots[i] = m->slots[j];
+            m->slots[j].key = 0;
+            i = j;
+        }
+    }
+}
+
+// ---------- history search ----------
+// Trigram index over the history ring, built lazily on the first search
+// and extended with whatever was added since. Each trigram maps to the
+// ascending seqs of the entries containing it, stored as varint deltas.
+// A search scans the shortest list among the pattern's trigrams and
+// confirms each candidate with memmem.
+typedef struct {
+    unsigned char *buf;
+    unsigned len, cap;
+    unsigned count;
+    unsigned long last;   // last seq appended
+} Posting;
+
+static IntMap        hist_trigrams;
+static unsigned long hist_indexed = 0;     // seqs below this are indexed
+static unsigned long hist_index_base = 0;  // oldest seq the index knows about
+
+static int trigram_key(const unsigned char *p) {
+    return (int)(((unsigned)p[0] << 16 | (unsigned)p[1] << 8 | p[2]) + 1);
+}
+
+static void posting_add(Posting *pp, unsigned long seq) {
+    if (pp->count && pp->last == seq) return;   // trigram repeats within one entry
+    unsigned long d = seq - pp->last;
+    if (pp->len + 10 > pp->cap) {
+        pp->cap = pp->cap ? pp->cap*2 : 16;
+        pp->buf = realloc(pp->buf, pp->cap);
     }
+    do {
+        unsigned char b = d & 0x7f;
+        d >>= 7;
+        pp->buf[pp->len++] = b | (d ? 0x80 : 0);
+    } while (d);
+    pp->last = seq;
+    pp->count++;
 }
 
-// Execute a (possibly piped) command line.
-// If background==true, don't wait; add to jobs.
-static void execute_line(char *line, bool background, const char *full_cmd_for_jobs) {
-    // Split into pipeline segments
-    char *segments[MAX_CMDS];
-    int nseg = split_pipeline(line, segments, MAX_CMDS);
-    if (nseg <= 0) return;
+static void hist_index_drop() {
+    for (size_t i=0;i<hist_trigrams.cap;i++) {
+        if (!hist_trigrams.slots[i].key) continue;
+        Posting *pp = hist_trigrams.slots[i].val;
+        free(pp->buf); free(pp);
+    }
+    free(hist_trigrams.slots);
+    memset(&hist_trigrams, 0, sizeof(hist_trigrams));
+    hist_indexed = hist_index_base = 0;
+}
 
-    // If single built-in without pipes, run in-process
-    Command first;
-    if (nseg == 1) {
-        char tmp[MAX_INPUT]; strncpy(tmp, segments[0], sizeof(tmp)-1); tmp[sizeof(tmp)-1]=0;
-        parse_command(tmp, &first);
-        if (is_builtin(&first)) {
-            run_builtin(&first, full_cmd_for_jobs);
-            return;
+static void hist_index_update() {
+    // once most of what the index covers has left the ring, start over
+    if (hist_indexed && hist_first - hist_index_base > hist_size) hist_index_drop();
+    if (hist_indexed < hist_first) hist_indexed = hist_index_base = hist_first;
+    for (; hist_indexed < hist_next; hist_indexed++) {
+        const HistEntry *e = hist_at(hist_indexed);
+        const unsigned char *p = (const unsigned char *)e->s;
+        for (unsigned i=0;i+3<=e->len;i++) {
+            int key = trigram_key(p+i);
+            Posting *pp = intmap_get(&hist_trigrams, key);
+            if (!pp) { pp = calloc(1, sizeof(Posting)); intmap_put(&hist_trigrams, key, pp); }
+            posting_add(pp, hist_indexed);
         }
     }
+}
 
-    int pipes[MAX_CMDS-1][2];
-    for (int i=0;i<nseg-1;i++) if (pipe(pipes[i]) == -1) { perror("pipe"); return; }
+static bool hist_entry_matches(const HistEntry *e, const char *pat, size_t plen) {
+    return plen <= e->len && memmem(e->s, e->len, pat, plen) != NULL;
+}
 
-    pid_t pgid = 0;
-    for (int i=0;i<nseg;i++) {
-        // parse each segment fresh
-        char tmp[MAX_INPUT]; strncpy(tmp, segments[i], sizeof(tmp)-1); tmp[sizeof(tmp)-1]=0;
-        Command cmd; parse_command(tmp, &cmd);
-        pid_t pid = fork();
-        if (pid == -1) { perror("fork"); return; }
-        if (pid == 0) {
-            // child: process group, signals default
-            signal(SIGINT, SIG_DFL);
-            signal(SIGTSTP, SIG_DFL);
+// All retained entries containing pat, oldest first, in a malloc'd array.
+static unsigned long *hist_search(const char *pat, size_t *nout) {
+    size_t plen = strlen(pat), n = 0, cap = 16;
+    unsigned long *out = malloc(cap * sizeof(unsigned long));
+    if (plen < 3) {
+        // too short to have a trigram: scan the ring
+        for (unsigned long q = hist_first; q < hist_next; q++) {
+            if (!hist_entry_matches(hist_at(q), pat, plen)) continue;
+            if (n == cap) out = realloc(out, (cap *= 2) * sizeof(unsigned long));
+            out[n++] = q;
+        }
+        *nout = n;
+        return out;
+    }
+    hist_index_update();
+    const Posting *best = NULL;
+    for (size_t i=0;i+3<=plen;i++) {
+        const Posting *pp = intmap_get(&hist_trigrams, trigram_key((const unsigned char *)pat+i));
+        if (!pp) { *nout = 0; return out; }
+        if (!best || pp->count < best->count) best = pp;
+    }
+    unsigned long seq = 0;
+    for (unsigned off = 0; off < best->len; ) {
+        unsigned long d = 0;
+        for (int shift = 0;; shift += 7) {
+            unsigned char b = best->buf[off++];
+            d |= (unsigned long)(b & 0x7f) << shift;
+            if (!(b & 0x80)) break;
+        }
+        seq += d;
+        if (seq < hist_first || !hist_entry_matches(hist_at(seq), pat, plen)) continue;
+        if (n == cap) out = realloc(out, (cap *= 2) * sizeof(unsigned long));
+        out[n++] = seq;
+    }
+    *nout = n;
+    return out;
+}
 
-            if (pgid == 0) pgid = getpid();
-            setpgid(0, pgid);
-            if (!background && i==0) tcsetpgrp(STDIN_FILENO, pgid);
+// ---------- string interning ----------
+// Job command lines are shared: a fan-out of identical workers keeps one copy.
+typedef struct { char *s; int refs; } InternSlot;
 
-            // connect pipes
-            if (i > 0) { // read from previous
-                dup2(pipes[i-1][0], STDIN_FILENO);
-            }
-            if (i < nseg-1) { // write to next
-                dup2(pipes[i][1], STDOUT_FILENO);
-            }
-            // close all pipe fds in child
-            for (int k=0;k<nseg-1;k++) {
-                close(pipes[k][0]); close(pipes[k][1]);
-            }
+static InternSlot *interned = NULL;
+static size_t      intern_cap = 0, intern_len = 0;
+
+static size_t intern_slot(const char *s) {
+    size_t i = str_hash(s) & (intern_cap-1);
+    while (interned[i].s && strcmp(interned[i].s, s) != 0) i = (i+1) & (intern_cap-1);
+    return i;
+}
 
-            // redirections
-            setup_redirections(&cmd);
+static const char *intern(const char *s) {
+    if ((intern_len+1)*2 > intern_cap) {
+        InternSlot *old = interned; size_t oldcap = intern_cap;
+        intern_cap = oldcap ? oldcap*2 : 64;
+        interned = calloc(intern_cap, sizeof(InternSlot));
+        for (size_t i=0;i<oldcap;i++) if (old[i].s) interned[intern_slot(old[i].s)] = old[i];
+        free(old);
+    }
+    size_t i = intern_slot(s);
+    if (!interned[i].s) { interned[i].s = strdup(s); intern_len++; }
+    interned[i].refs++;
+    return interned[i].s;
+}
 
-            // exec (builtins inside pipeline need a subshell; we skip and only exec real commands)
-            if (!cmd.argv[0]) _exit(0);
-            execvp(cmd.argv[0], cmd.argv);
-            perror("execvp");
-            _exit(127);
-        } else {
-            // parent
-            if (pgid == 0) pgid = pid;
-            setpgid(pid, pgid);
+static void intern_release(const char *s) {
+    size_t i = intern_slot(s);
+    if (!interned[i].s || --interned[i].refs > 0) return;
+    free(interned[i].s);
+    interned[i].s = NULL;
+    intern_len--;
+    for (size_t j = (i+1) & (intern_cap-1); interned[j].s; j = (j+1) & (intern_cap-1)) {
+        size_t home = str_hash(interned[j].s) & (intern_cap-1);
+        if (((j - home) & (intern_cap-1)) >= ((j - i) & (intern_cap-1))) {
+            interned[i] = interned[j];
+            interned[j].s = NULL;
+            i = j;
         }
     }
+}
 
-    // parent: close all pipe fds
-    for (int i=0;i<nseg-1;i++) { close(pipes[i][0]); close(pipes[i][1]); }
+// ---------- cgroups ----------
+// With set -o cgroup-root=DIR (a cgroup v2 directory delegated to us),
+// every job gets a leaf DIR/mysh-<shell pid>-<n> with the configured
+// cpu.max, memory.max and io.max. Each stage writes itself to the leaf's
+// cgroup.procs before exec, so nothing it starts can get out. The leaf
+// is removed with the job.
+static char *cgroup_root = NULL;
+static char *cgroup_cpu_max = NULL, *cgroup_memory_max = NULL, *cgroup_io_max = NULL;
+static unsigned long cgroup_seq = 0;
+static char  **cgroup_busy = NULL;   // leaves still in use when their job went
+static size_t  cgroup_nbusy = 0;
 
-    if (background) {
-        add_job_entry(pgid, full_cmd_for_jobs, JOB_RUNNING);
-        printf("[%%%d] started in background, PGID=%d\n", jobs[job_count-1].id, pgid);
-        // keep shell controlling terminal
-        tcsetpgrp(STDIN_FILENO, getpgrp());
+static int cgroup_write(const char *dir, const char *file, const char *val) {
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write(fd, val, strlen(val)) < 0) {
+        fprintf(stderr, "mysh: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+static ssize_t cgroup_read(const char *dir, const char *file, char *buf, size_t n) {
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t len = read(fd, buf, n-1);
+    close(fd);
+    if (len >= 0) buf[len] = '\0';
+    return len;
+}
+
+// Make a leaf for a new job. Returns its path, with *procs_fd open on its
+// cgroup.procs for the stages to join through, or NULL (and *procs_fd -1)
+// when cgroups are off or the leaf can't be set up.
+static char *cgroup_create(int *procs_fd) {
+    *procs_fd = -1;
+    if (!cgroup_root) return NULL;
+    for (size_t i=0;i<cgroup_nbusy;) {
+        if (rmdir(cgroup_busy[i]) == 0 || errno != EBUSY) { free(cgroup_busy[i]); cgroup_busy[i] = cgroup_busy[--cgroup_nbusy]; }
+        else i++;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/mysh-%d-%lu", cgroup_root, (int)getpid(), ++cgroup_seq);
+    if (mkdir(path, 0755) < 0) { fprintf(stderr, "mysh: %s: %s\n", path, strerror(errno)); return NULL; }
+    if ((cgroup_cpu_max && cgroup_write(path, "cpu.max", cgroup_cpu_max) < 0) ||
+        (cgroup_memory_max && cgroup_write(path, "memory.max", cgroup_memory_max) < 0) ||
+        (cgroup_io_max && cgroup_write(path, "io.max", cgroup_io_max) < 0)) {
+        rmdir(path);
+        return NULL;
+    }
+    char procs[PATH_MAX + 16];
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", path);
+    *procs_fd = shell_fd(open(procs, O_WRONLY | O_CLOEXEC));
+    if (*procs_fd < 0) {
+        perror(procs);
+        rmdir(path);
+        return NULL;
+    }
+    return strdup(path);
+}
+
+// Drop a job's leaf. Anything the job left running keeps it busy; the
+// leaf then stays, still accounting for it, and removal is retried as
+// later jobs are created.
+static void cgroup_destroy(char *path) {
+    if (rmdir(path) < 0 && errno == EBUSY) {
+        cgroup_busy = realloc(cgroup_busy, sizeof(char *) * (cgroup_nbusy + 1));
+        cgroup_busy[cgroup_nbusy++] = path;
         return;
     }
+    free(path);
+}
 
-    // Foreground: wait for the whole group
-    int status;
-    tcsetpgrp(STDIN_FILENO, pgid);
-    while (waitpid(-pgid, &status, WUNTRACED) > 0) {
-        if (WIFSTOPPED(status)) {
-            int idx = find_job_index_by_pgid(pgid);
-            if (idx < 0) add_job_entry(pgid, full_cmd_for_jobs, JOB_STOPPED);
-            else jobs[idx].state = JOB_STOPPED;
-            printf("\n[stopped] %s\n", full_cmd_for_jobs);
-            break;
+// Signal everything in the leaf, escaped children included. SIGKILL goes
+// through cgroup.kill, which also catches processes forking as it runs.
+// Returns -1 if the leaf couldn't be used.
+static int cgroup_signal(const char *path, int sig) {
+    if (sig == SIGKILL) {
+        char f[PATH_MAX + 16];
+        snprintf(f, sizeof(f), "%s/cgroup.kill", path);
+        int fd = open(f, O_WRONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            ssize_t n = write(fd, "1", 1);
+            close(fd);
+            if (n == 1) return 0;
         }
     }
-    // Restore control of terminal to shell
-    tcsetpgrp(STDIN_FILENO, getpgrp());
+    char buf[65536];
+    if (cgroup_read(path, "cgroup.procs", buf, sizeof(buf)) < 0) return -1;
+    for (char *p = buf, *end; *p; p = end) {
+        long pid = strtol(p, &end, 10);
+        if (end == p) break;
+        if (pid > 0) kill((pid_t)pid, sig);
+    }
+    return 0;
 }
 
-// ---------- main loop ----------
-int main() {
-    install_signal_handlers();
-    load_history();
+// The leaf's own accounting for jobs -v: cpu.stat covers every process
+// that ever ran in it, and memory.peak is the high-water mark of the lot.
+static void cgroup_print_stats(const char *path) {
+    char buf[4096];
+    long usage = -1, throttled = -1, periods = -1;
+    if (cgroup_read(path, "cpu.stat", buf, sizeof(buf)) > 0) {
+        for (char *line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+            char key[64];
+            long v;
+            if (sscanf(line, "%63s %ld", key, &v) != 2) continue;
+            if (strcmp(key, "usage_usec") == 0) usage = v;
+            else if (strcmp(key, "throttled_usec") == 0) throttled = v;
+            else if (strcmp(key, "nr_throttled") == 0) periods = v;
+        }
+    }
+    printf("      cgroup %s", path);
+    if (usage >= 0) printf("  cpu %.3fs", usage / 1e6);
+    if (throttled >= 0) printf("  throttled %.3fs (%ld periods)", throttled / 1e6, periods);
+    if (cgroup_read(path, "memory.peak", buf, sizeof(buf)) > 0) printf("  memory.peak %ldK", atol(buf) / 1024);
+    putchar('\n');
+}
+
+// ---------- job table ----------
+static Job   *jobs_head = NULL, *jobs_tail = NULL;
+static IntMap jobs_by_id, jobs_by_pgid, jobs_by_pid;
+static int    next_job_id = 1;
+static int    done_jobs = 0;   // jobs in JOB_DONE awaiting removal
 
-    // Put shell in its own process group and take terminal
-    pid_t shell_pgid = getpid();
-    setpgid(shell_pgid, shell_pgid);
-    tcsetpgrp(STDIN_FILENO, shell_pgid);
+static Job *find_job_by_id(int id) {
+    return id > 0 ? intmap_get(&jobs_by_id, id) : NULL;
+}
 
-    char line_in[MAX_INPUT];
+static Job *find_job_by_pgid(pid_t pgid) {
+    return pgid > 0 ? intmap_get(&jobs_by_pgid, pgid) : NULL;
+}
 
-    while (1) {
-        // prompt: user@host:cwd$
-        char cwd[1024]; getcwd(cwd, sizeof(cwd));
-        printf("mysh:%s$ ", cwd ? cwd : "");
-        fflush(stdout);
+// Job argument for fg/bg/kill: a job id (optionally %N), else a PGID as
+// printed by jobs.
+static Job *resolve_job(const char *arg) {
+    if (*arg == '%') arg++;
+    int n = atoi(arg);
+    Job *j = find_job_by_id(n);
+    return j ? j : find_job_by_pgid(n);
+}
+
+static JobProc *job_find_proc(Job *j, pid_t pid) {
+    for (int i=0;i<j->nprocs;i++) if (j->procs[i].pid == pid) return &j->procs[i];
+    return NULL;
+}
+
+static void job_update_state(Job *j) {
+    job_state old = j->state;
+    if (j->nalive == 0) j->state = JOB_DONE;
+    else {
+        j->state = JOB_RUNNING;
+        for (int i=0;i<j->nprocs;i++) if (j->procs[i].state == JOB_STOPPED) j->state = JOB_STOPPED;
+    }
+    if (j->state == JOB_DONE && old != JOB_DONE) done_jobs++;
+}
+
+static void timeval_add(struct timeval *a, const struct timeval *b) {
+    a->tv_sec += b->tv_sec;
+    a->tv_usec += b->tv_usec;
+    if (a->tv_usec >= 1000000) { a->tv_sec++; a->tv_usec -= 1000000; }
+}
+
+static double tv_secs(const struct timeval *t) {
+    return (double)t->tv_sec + (double)t->tv_usec / 1e6;
+}
+
+static double ts_diff(const struct timespec *a, const struct timespec *b) {
+    return (double)(b->tv_sec - a->tv_sec) + (double)(b->tv_nsec - a->tv_nsec) / 1e9;
+}
 
-        if (!fgets(line_in, sizeof(line_in), stdin)) {
-            putchar('\n'); break;
+static void ru_accumulate(struct rusage *acc, const struct rusage *ru) {
+    timeval_add(&acc->ru_utime, &ru->ru_utime);
+    timeval_add(&acc->ru_stime, &ru->ru_stime);
+    if (ru->ru_maxrss > acc->ru_maxrss) acc->ru_maxrss = ru->ru_maxrss;
+    acc->ru_nvcsw += ru->ru_nvcsw;
+    acc->ru_nivcsw += ru->ru_nivcsw;
+}
+
+// Record a wait status (and, at exit, resource usage) for pid. Returns its
+// job, or NULL if it isn't ours.
+static Job *job_note_status(pid_t pid, int status, const struct rusage *ru) {
+    Job *j = intmap_get(&jobs_by_pid, pid);
+    if (!j) return NULL;
+    JobProc *p = job_find_proc(j, pid);
+    // A forked child can't tell us its execv() of the cached path failed,
+    // only exit 127 once the PATH search failed too; and any command may
+    // exit 127 itself. So it has to be the cached binary that's gone.
+    if (p->hashed && WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+        const char *cached = hash_cached(p->hashed);
+        if (cached && access(cached, X_OK) < 0 && errno == ENOENT) hash_forget(p->hashed);
+    }
+    if (WIFSTOPPED(status)) p->state = JOB_STOPPED;
+    else if (WIFCONTINUED(status)) p->state = JOB_RUNNING;
+    else if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        p->state = JOB_DONE;
+        p->status = status;
+        if (ru) { p->ru = *ru; ru_accumulate(&j->ru, ru); }
+        if (--j->nalive == 0) clock_gettime(CLOCK_MONOTONIC, &j->finished);
+        intmap_del(&jobs_by_pid, pid);   // the kernel may hand the pid out again
+    }
+    job_update_state(j);
+    return j;
+}
+
+// Create a job for a launched pipeline. It gets a visible id only once it
+// is backgrounded or stopped (job_assign_id). A stage that couldn't be
+// launched (pid -1) keeps its slot as a finished proc, exit 127 unless
+// the caller says otherwise, so procs[i] is always stage i.
+static Job *job_create(pid_t pgid, const char *cmdline, const pid_t *pids, char **hashed,
+                       char *const *names, int n) {
+    Job *j = calloc(1, sizeof(Job));
+    j->pgid = pgid;
+    j->cmdline = intern(cmdline);
+    clock_gettime(CLOCK_MONOTONIC, &j->started);
+    j->procs = calloc(n, sizeof(JobProc));
+    j->nprocs = n;
+    for (int i=0;i<n;i++) {
+        JobProc *p = &j->procs[i];
+        p->name = intern(names[i] ? names[i] : "");
+        if (pids[i] <= 0) {
+            p->state = JOB_DONE;
+            p->status = W_EXITCODE(127, 0);
+            free(hashed[i]);
+            continue;
         }
-        line_in[strcspn(line_in, "\n")] = 0;
-        char full_line[MAX_INPUT]; strncpy(full_line, line_in, sizeof(full_line)-1); full_line[sizeof(full_line)-1]=0;
+        p->pid = pids[i];
+        p->hashed = hashed[i];
+        intmap_put(&jobs_by_pid, pids[i], j);
+        j->nalive++;
+    }
+    j->prev = jobs_tail;
+    if (jobs_tail) jobs_tail->next = j; else jobs_head = j;
+    jobs_tail = j;
+    // a job left in the shell's own group (no job control, parallel, on)
+    // has no group of its own to be found by
+    if (pgid != getpgrp()) intmap_put(&jobs_by_pgid, pgid, j);
+    job_update_state(j);
+    return j;
+}
 
-        trim(line_in);
-        if (!*line_in) continue;
+static void job_assign_id(Job *j) {
+    if (j->id) return;
+    j->id = next_job_id++;
+    intmap_put(&jobs_by_id, j->id, j);
+}
+
+static void job_remove(Job *j) {
+    if (j->state == JOB_DONE) done_jobs--;
+    if (j->id) intmap_del(&jobs_by_id, j->id);
+    if (intmap_get(&jobs_by_pgid, j->pgid) == j) intmap_del(&jobs_by_pgid, j->pgid);
+    for (int i=0;i<j->nprocs;i++) {
+        if (j->procs[i].state != JOB_DONE && intmap_get(&jobs_by_pid, j->procs[i].pid) == j)
+            intmap_del(&jobs_by_pid, j->procs[i].pid);
+        free(j->procs[i].hashed);
+        intern_release(j->procs[i].name);
+    }
+    if (j->prev) j->prev->next = j->next; else jobs_head = j->next;
+    if (j->next) j->next->prev = j->prev; else jobs_tail = j->prev;
+    intern_release(j->cmdline);
+    if (j->cgroup) cgroup_destroy(j->cgroup);
+    free(j->procs);
+    free(j);
+}
+
+static const char *state_name(job_state st) {
+    return st==JOB_RUNNING ? "Running" : st==JOB_STOPPED ? "Stopped" : "Done";
+}
+
+static void print_rusage(FILE *f, const struct rusage *ru) {
+    fprintf(f, "user %.3fs  sys %.3fs  maxrss %ldK  ctxsw %ld/%ld",
+            tv_secs(&ru->ru_utime), tv_secs(&ru->ru_stime), ru->ru_maxrss,
+            ru->ru_nvcsw, ru->ru_nivcsw);
+}
 
-        // history add (skip duplicate consecutive)
-        if (history_len==0 || strcmp(history[history_len-1], full_line)!=0) add_history(full_line);
+// Wall time so far, or in total once the job is done.
+static double job_wall(const Job *j) {
+    struct timespec now;
+    if (j->state == JOB_DONE) now = j->finished;
+    else clock_gettime(CLOCK_MONOTONIC, &now);
+    return ts_diff(&j->started, &now);
+}
 
-        // background?
-        bool background = false;
-        int len = (int)strlen(line_in);
-        if (len>0 && line_in[len-1] == '&') {
-            background = true;
-            line_in[len-1] = 0;
-            trim(line_in);
+// verbose: add per-stage resource usage (jobs -v)
+static void print_jobs(bool verbose) {
+    for (Job *j = jobs_head; j; j = j->next) {
+        if (!j->id || j->state == JOB_DONE) continue; // optional: hide done
+        printf("[%d] %d  %-8s  %s\n", j->id, j->pgid, state_name(j->state), j->cmdline);
+        if (!verbose) continue;
+        printf("      wall %.3fs  ", job_wall(j));
+        print_rusage(stdout, &j->ru);
+        putchar('\n');
+        for (int i=0;i<j->nprocs;i++) {
+            const JobProc *p = &j->procs[i];
+            printf("      %-7d %-8s %-12s ", p->pid, state_name(p->state), p->name);
+            if (p->state == JOB_DONE) print_rusage(stdout, &p->ru);
+            putchar('\n');
         }
+        if (j->cgroup) cgroup_print_stats(j->cgroup);
+    }
+}
 
-        // Execute (builtins handled inside execute_line for single, else via run_builtin)
-        execute_line(line_in, background, full_line);
+// The `time` report, bash style, plus a line per stage for pipelines.
+static void print_time_report(double real, const struct rusage *ru) {
+    fprintf(stderr, "\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\n",
+            (int)(real/60), real - 60*(int)(real/60),
+            (int)(tv_secs(&ru->ru_utime)/60), tv_secs(&ru->ru_utime) - 60*(int)(tv_secs(&ru->ru_utime)/60),
+            (int)(tv_secs(&ru->ru_stime)/60), tv_secs(&ru->ru_stime) - 60*(int)(tv_secs(&ru->ru_stime)/60));
+}
 
-        // cleanup finished jobs spam
-        remove_done_jobs();
+static void job_report(const Job *j) {
+    if (!j->timed) return;
+    print_time_report(job_wall(j), &j->ru);
+    if (j->nprocs < 2) return;
+    for (int i=0;i<j->nprocs;i++) {
+        fprintf(stderr, "  [%d] %-12s ", i+1, j->procs[i].name);
+        print_rusage(stderr, &j->procs[i].ru);
+        fputc('\n', stderr);
     }
+}
 
-    save_history();
-    // free history
-    for (int i=0;i<history_len;i++) free(history[i]);
-    return 0;
+// How many finished jobs a script remembers for `wait` to collect.
+#define DONE_JOBS_KEPT 1024
+
+// Drop finished jobs, announcing the background ones. A script keeps
+// them, dropping only the oldest past DONE_JOBS_KEPT, so `wait %N` and
+// `wait -n` still find a job that ended before they ran.
+static void remove_done_jobs() {
+    int keep = interactive ? 0 : DONE_JOBS_KEPT;
+    if (done_jobs <= keep) return;
+    for (Job *j = jobs_head, *next; j && done_jobs > keep; j = next) {
+        next = j->next;
+        if (j->state != JOB_DONE) continue;
+        if (j->id && interactive) printf("[%d] Done      %s\n", j->id, j->cmdline);
+        job_report(j);
+        job_remove(j);
+    }
+}
+
+// Signal every process of a job: through its cgroup when it has one, so
+// children that left the process group get it too. A job in the shell's
+// own process group (every job without job control; parallel and on runs
+// with it) is signalled one process at a time, never the shell too.
+static void job_signal(Job *j, int sig) {
+    if (j->cgroup && cgroup_signal(j->cgroup, sig) == 0) return;
+    if (job_control && j->pgid != getpgrp()) {
+        if (kill(-j->pgid, sig) == -1) perror("kill");
+        return;
+    }
+    for (int i=0;i<j->nprocs;i++)
+        if (j->procs[i].state != JOB_DONE) kill(j->procs[i].pid, sig);
+}
+
+// Wait until a foreground job finishes or stops.
+static void wait_for_job(Job *j) {
+    int status;
+    pid_t pid;
+    struct rusage ru;
+    while (j->state == JOB_RUNNING) {
+        pid = wait4(-j->pgid, &status, WUNTRACED, &ru);
+        if (pid < 0) { if (errno == EINTR) continue; break; }
+        job_note_status(pid, status, &ru);
+    }
+}
+
+// A stage's exit status as $? shows it; stopped counts as SIGTSTP.
+static int proc_status(const Job *j, int i) {
+    if (j->procs[i].state == JOB_STOPPED) return 128 + SIGTSTP;
+    int st = j->procs[i].status;
+    return WIFSIGNALED(st) ? 128 + WTERMSIG(st) : WEXITSTATUS(st);
+}
+
+static int job_status(const Job *j) {
+    if (j->state == JOB_STOPPED) return 128 + SIGTSTP;
+    return j->nprocs ? proc_status(j, j->nprocs-1) : 0;
+}
+
+// A finished job failed if its last stage did, as for $? in sh.
+static bool job_failed(const Job *j) {
+    if (!j->nprocs) return false;
+    int st = j->procs[j->nprocs-1].status;
+    return !WIFEXITED(st) || WEXITSTATUS(st) != 0;
+}
+
+// After a foreground wait: keep a stopped job, drop a finished one.
+static void finish_foreground(Job *j) {
+    if (j->state == JOB_STOPPED) {
+        job_assign_id(j);
+        printf("\n[stopped] %s\n", j->cmdline);
+    } else if (j->state == JOB_DONE) {
+        job_report(j);
+        job_remove(j);
+    }
+}
+
+// ---------- signals ----------
+// SIGCHLD is never handled in signal context. On Linux it stays blocked and
+// is read from a signalfd; elsewhere a handler only writes to a self-pipe.
+// Either way the main loop polls child_event_fd next to stdin and reaps in
+// batches with reap_children().
+static int child_event_fd = -1;
+
+#ifndef __linux__
+static int self_pipe[2] = { -1, -1 };
+
+static void sigchld_handler(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    char c = 0;
+    (void)!write(self_pipe[1], &c, 1);
+    errno = saved_errno;
+}
+#endif
+
+static void install_signal_handlers() {
+#ifdef __linux__
+    sigset_t chld;
+    sigemptyset(&chld); sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    child_event_fd = shell_fd(signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC));
+    if (child_event_fd < 0) perror("signalfd");
+#else
+    if (pipe(self_pipe) == 0) {
+        for (int i=0;i<2;i++) {
+            fcntl(self_pipe[i], F_SETFL, O_NONBLOCK);
+            fcntl(self_pipe[i], F_SETFD, FD_CLOEXEC);
+            self_pipe[i] = shell_fd(self_pipe[i]);
+        }
+        child_event_fd = self_pipe[0];
+    } else perror("pipe");
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    // no SA_NOCLDSTOP: stopped background jobs should wake the loop too
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+#endif
+
+    // Ignore Ctrl-C in an interactive shell; children will reset to default
+    if (!interactive) return;
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    // lets the shell take the terminal back from a finished job
+    signal(SIGTTOU, SIG_IGN);
+}
+
+// Drain pending child notifications and update the job table in one batch.
+static void reap_children() {
+    char buf[1024];   // a batch of signalfd_siginfo records or self-pipe bytes
+    if (child_event_fd >= 0) {
+        bool pending = false;
+        while (read(child_event_fd, buf, sizeof(buf)) > 0) pending = true;
+        if (!pending) return;   // nothing changed state since the last batch
+    }
+    int status;
+    pid_t pid;
+    struct rusage ru;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0)
+        job_note_status(pid, status, &ru);
+}
+
+// Block until any child changes state, then take the rest of the batch.
+// Returns -1 if there are no children left to wait for.
+static int wait_any_child() {
+    int status;
+    struct rusage ru;
+    pid_t pid = wait4(-1, &status, WUNTRACED, &ru);
+    if (pid < 0) return errno == EINTR ? 0 : -1;
+    job_note_status(pid, status, &ru);
+    reap_children();
+    return 0;
+}
+
+// ---------- event loop ----------
+// Buffered line input over read(2), so poll() sees exactly what stdio
+// would otherwise have hidden in its buffer. Scripts and -c strings are
+// read straight out of memory instead, with no line-length limit.
+typedef struct {
+    int    fd;                // -1 when reading from map
+    char  *buf;
+    size_t start, len, cap;   // unread bytes are buf[start..len)
+    bool   eof;
+    const char *map;          // mmap'd script or -c string
+    size_t map_pos, map_len;
+    char  *line;              // NUL-terminated copy of the current map line
+    size_t line_cap;
+} LineReader;
+
+#define READ_BLOCK 65536
+
+static char *read_map_line(LineReader *r) {
+    if (r->map_pos >= r->map_len) return NULL;
+    const char *p = r->map + r->map_pos;
+    size_t left = r->map_len - r->map_pos;
+    const char *nl = memchr(p, '\n', left);
+    size_t n = nl ? (size_t)(nl - p) : left;
+    if (n + 1 > r->line_cap) {
+        r->line_cap = n + 1 > 256 ? (n + 1) * 2 : 256;
+        r->line = realloc(r->line, r->line_cap);
+    }
+    memcpy(r->line, p, n);
+    r->line[n] = '\0';
+    r->map_pos += n + (nl ? 1 : 0);
+    return r->line;
+}
+
+// Returns the next line without its newline, or NULL at end of input. The
+// pointer is valid until the next call. While no full line is buffered,
+// waits on the input and child events together and reaps as they arrive.
+static char *read_line(LineReader *r) {
+    if (r->map) return read_map_line(r);
+    for (;;) {
+        char *nl = memchr(r->buf + r->start, '\n', r->len - r->start);
+        if (nl) {
+            char *line = r->buf + r->start;
+            *nl = '\0';
+            r->start = (size_t)(nl - r->buf) + 1;
+            return line;
+        }
+        if (r->eof) {
+            if (r->start == r->len) return NULL;
+            char *line = r->buf + r->start;
+            r->buf[r->len] = '\0';
+            r->start = r->len;
+            return line;
+        }
+        if (r->start > 0) {
+            memmove(r->buf, r->buf + r->start, r->len - r->start);
+            r->len -= r->start; r->start = 0;
+        }
+        // a terminal hands over a line per read; batch input gets big blocks
+        size_t want = interactive ? 4096 : READ_BLOCK;
+        if (r->cap - r->len < want + 1) {
+            while (r->cap - r->len < want + 1) r->cap = r->cap ? r->cap*2 : want + 1;
+            r->buf = realloc(r->buf, r->cap);
+        }
+
+        struct pollfd pfd[2] = {
+            { .fd = r->fd, .events = POLLIN },
+            { .fd = child_event_fd, .events = POLLIN },
+        };
+        if (poll(pfd, child_event_fd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll"); r->eof = true; continue;
+        }
+        if (pfd[1].revents & POLLIN) reap_children();
+        if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        ssize_t n = read(r->fd, r->buf + r->len, r->cap - r->len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) r->eof = true;
+        else r->len += (size_t)n;
+    }
+}
+
+// ---------- arena ----------
+// Bump allocator for everything parsed from one line; reset in one shot
+// once the line has run. The first block is kept, so steady-state parsing
+// does no malloc at all.
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used, cap;
+    char   data[];
+} ArenaBlock;
+
+typedef struct { ArenaBlock *head; } Arena;
+
+static void *arena_alloc(Arena *a, size_t n) {
+    n = (n + 15) & ~(size_t)15;
+    ArenaBlock *b = a->head;
+    if (!b || b->cap - b->used < n) {
+        size_t cap = n > 16384 ? n : 16384;
+        b = malloc(sizeof(ArenaBlock) + cap);
+        if (!b) { perror("malloc"); exit(1); }
+        b->used = 0; b->cap = cap;
+        b->next = a->head;
+        a->head = b;
+    }
+    void *p = b->data + b->used;
+    b->used += n;
+    return p;
+}
+
+static void *arena_zalloc(Arena *a, size_t n) {
+    return memset(arena_alloc(a, n), 0, n);
+}
+
+// Resize p, the arena's most recent allocation, from old to n bytes. It
+// grows in place while it is still the top of the current block, so a
+// vector built up one item at a time is copied only on block overflow.
+static void *arena_realloc(Arena *a, void *p, size_t old, size_t n) {
+    ArenaBlock *b = a->head;
+    size_t o = (old + 15) & ~(size_t)15, nn = (n + 15) & ~(size_t)15;
+    if (p && b && (char *)p + o == b->data + b->used && b->cap - b->used + o >= nn) {
+        b->used += nn - o;
+        return p;
+    }
+    void *q = arena_alloc(a, n);
+    if (p) memcpy(q, p, old);
+    return q;
+}
+
+// A point to go back to: what was allocated after it is dropped, what
+// came before stays. Lets a loop body run any number of times in the
+// same arena.
+typedef struct { ArenaBlock *head; size_t used; } ArenaMark;
+
+static ArenaMark arena_mark(const Arena *a) {
+    return (ArenaMark){ a->head, a->head ? a->head->used : 0 };
+}
+
+static void arena_release(Arena *a, ArenaMark m) {
+    while (a->head != m.head) { ArenaBlock *next = a->head->next; free(a->head); a->head = next; }
+    if (a->head) a->head->used = m.used;
+}
+
+static void arena_free(Arena *a) {
+    arena_release(a, (ArenaMark){ NULL, 0 });
+}
+
+static void arena_reset(Arena *a) {
+    ArenaBlock *b = a->head;
+    if (!b) return;
+    // keep the oldest block; later ones were overflow
+    while (b->next) { ArenaBlock *next = b->next; free(b); b = next; }
+    b->used = 0;
+    a->head = b;
+}
+
+// ---------- parsing ----------
+typedef enum {
+    R_IN,        // <
+    R_OUT,       // > and >|
+    R_APPEND,    // >>
+    R_RDWR,      // <>
+    R_DUP,       // <&N, >&N, and >&- to close
+    R_HEREDOC,   // << and <<-: the body, read after the line
+    R_HERESTR,   // <<< word, with a newline added
+} redir_kind;
+
+// Redirections apply in source order; &>file is parsed as >file 2>&1.
+typedef struct Redir {
+    redir_kind kind;
+    int   fd;         // the descriptor redirected
+    char *word;       // file name, fd number, or here-doc body
+    bool  strip;      // <<-: leading tabs go
+    bool  literal;    // quoted here-doc delimiter: no expansion in the body
+    struct Redir *next;
+    struct Redir *hd_next;   // here-docs whose body is still to be read
+} Redir;
+
+typedef struct {
+    char **argv;     // NULL-terminated, in the line's arena
+    char *pin;       // `pin SPEC` prefix: a cpu list or node:N
+    Redir *redirs;   // in order, or NULL
+    struct Node *body;   // a compound command (or function definition) instead of argv
+    char **assign;   // NAME=value prefixes, NULL-terminated, or NULL
+    char **envp;     // environment with those applied, once expanded
+    bool  expand;    // has $ markers or assignments: expand before running
+} Command;
+
+typedef struct {
+    Command **cmds;            // stages of the pipeline
+    int   ncmds;
+    bool  background;          // trailing '&'
+    bool  timed;               // leading `time` keyword
+    bool  negate;              // leading `!`
+    bool  expand;              // some stage needs expanding
+} Pipeline;
+
+// A parsed line or script is a tree of these, built once and run as often
+// as a loop or function asks: only expansion happens per run.
+typedef enum { N_PIPELINE, N_LIST, N_AND, N_OR, N_IF, N_WHILE, N_UNTIL, N_FOR, N_FUNCDEF } node_kind;
+
+typedef struct Node {
+    node_kind kind;
+    Pipeline *pl;                  // N_PIPELINE
+    const char *text;              // N_PIPELINE: its source, for the job table
+    struct Node **kids;            // N_LIST, in order
+    int   nkids;
+    struct Node *cond, *body, *orelse;   // N_IF (elif is an N_IF in orelse), loops;
+                                         // N_AND, N_OR: cond && body, cond || body
+    char *var;                     // N_FOR
+    char **words;                  // N_FOR, NULL-terminated; NULL for "$@"
+    char *name;                    // N_FUNCDEF
+    const char *src;               // N_FUNCDEF: the body's source, parsed again to keep
+} Node;
+
+// A function keeps its body in an arena of its own, parsed from the
+// definition's source, so it outlives the line that defined it.
+typedef struct Func {
+    char  *name;
+    Arena  arena;
+    Node  *body;
+    int    busy;            // calls under way: a redefinition can't free it yet
+    bool   dead;            // replaced; freed when the last call returns
+    struct Func *next;
+} Func;
+
+static Func *funcs = NULL;
+
+static Func *find_function(const char *name) {
+    if (!funcs || !name) return NULL;
+    for (Func *f = funcs; f; f = f->next) if (strcmp(f->name, name) == 0) return f;
+    return NULL;
+}
+
+static int exec_node(Arena *a, const Node *n);
+static int call_function(Arena *a, Func *f, char **argv);
+
+typedef enum {
+    T_END, T_WORD, T_PIPE, T_OR, T_AMP, T_AND, T_SEMI, T_NL,
+    T_REDIR, T_LPAREN, T_RPAREN, T_ERROR
+} tok_type;
+
+// Single-pass lexer. Word text, with quotes and escapes removed, is written
+// into one arena buffer the size of the line; tokens are slices of it.
+typedef struct {
+    const char *p;   // read position in the source line
+    const char *tok; // where the current token starts
+    char *w;         // write position in the word buffer
+    tok_type type;
+    char *word;      // T_WORD text
+    char  quote;     // T_ERROR: the unmatched quote; '<' for a here-doc
+    bool  marked;    // the word has expansion markers
+    redir_kind rkind;   // T_REDIR
+    int   rfd;          // T_REDIR: the fd number before it, or -1
+    Redir *hd, **hd_tail;   // here-docs waiting for the next newline
+} Lexer;
+
+// Expansions are left in the word as markers and done when the command
+// runs, so a parsed line can run again with other values:
+//   CTL_VAR name CTL_END    unquoted $name, split into fields
+//   CTL_QVAR name CTL_END   "$name", kept whole
+//   CTL_QUOTE               an empty "" or '', which still makes a word
+//   CTL_CMD text CTL_END    $(text) or `text`, its output split
+//   CTL_QCMD text CTL_END   the same inside double quotes
+#define CTL_VAR   '\x01'
+#define CTL_QVAR  '\x02'
+#define CTL_END   '\x03'
+#define CTL_QUOTE '\x04'
+#define CTL_CMD   '\x05'
+#define CTL_QCMD  '\x06'
+
+// The ')' closing a $( whose text starts at p, past quotes, escapes and
+// nested parens; NULL if the line ends first.
+static const char *cmdsub_end(const char *p) {
+    int depth = 1;
+    for (; *p; p++) {
+        if (*p == '\\' && p[1]) p++;
+        else if (*p == '\'') { if (!(p = strchr(p+1, '\''))) return NULL; }
+        else if (*p == '"') {
+            for (p++; *p && *p != '"'; p++) if (*p == '\\' && p[1]) p++;
+            if (!*p) return NULL;
+        }
+        else if (*p == '(') depth++;
+        else if (*p == ')' && --depth == 0) return p;
+    }
+    return NULL;
+}
+
+// `text`: \`, \$ and \\ lose their backslash, the rest is copied as is.
+static bool lex_backtick(Lexer *lx, const char **pp, char **ww, char kind) {
+    const char *p = *pp + 1;
+    char *w = *ww;
+    *w++ = kind;
+    for (; *p != '`'; p++) {
+        if (!*p) { lx->type = T_ERROR; lx->quote = '`'; return false; }
+        if (*p == '\\' && p[1] && strchr("`$\\", p[1])) p++;
+        *w++ = *p;
+    }
+    *w++ = CTL_END;
+    *pp = p + 1;
+    *ww = w;
+    lx->marked = true;
+    return true;
+}
+
+
+static const char *tok_text(const Lexer *lx) {
+    static const char *names[] = { "end of file", "", "|", "||", "&", "&&", ";", "newline", "", "(", ")", "" };
+    static char op[8];
+    if (lx->type == T_REDIR) {   // as written
+        snprintf(op, sizeof(op), "%.*s", (int)(lx->p - lx->tok), lx->tok);
+        return op;
+    }
+    return lx->type == T_WORD ? lx->word : names[lx->type];
+}
+
+static bool is_meta(char c) {
+    return c==' ' || c=='\t' || c=='\n' || c=='|' || c=='&' || c==';' ||
+           c=='<' || c=='>' || c=='(' || c==')';
+}
+
+// After a '$': $(text), $name, ${name}, $0-$9, $#, $$, $@, $*. Anything
+// else is a plain dollar sign. Returns false on a bad ${...} or an
+// unclosed $(.
+static bool lex_dollar(Lexer *lx, const char **pp, char **ww, char kind) {
+    const char *p = *pp + 1, *name = p;
+    size_t n;
+    if (*p == '(') {   // $(text)
+        const char *end = cmdsub_end(p + 1);
+        if (!end) { lx->type = T_ERROR; lx->quote = ')'; return false; }
+        name = p + 1;
+        n = (size_t)(end - name);
+        kind = kind == CTL_QVAR ? CTL_QCMD : CTL_CMD;
+        *pp = end + 1;
+    } else if (*p == '{') {
+        name = p + 1;
+        const char *end = strchr(name, '}');
+        n = end ? (size_t)(end - name) : 0;
+        if (!end || !(n == name_len(name) || (n == 1 && (isdigit((unsigned char)*name) || strchr("#$@*?", *name))))) {
+            lx->type = T_ERROR; lx->quote = end ? 0 : '}';
+            return false;
+        }
+        *pp = end + 1;
+    } else if ((n = name_len(p))) {
+        *pp = p + n;
+    } else if (*p && (isdigit((unsigned char)*p) || strchr("#$@*?", *p))) {
+        n = 1;
+        *pp = p + 1;
+    } else {
+        *(*ww)++ = '$';
+        *pp = p;
+        return true;
+    }
+    char *w = *ww;
+    *w++ = kind;
+    memcpy(w, name, n); w += n;
+    *w++ = CTL_END;
+    *ww = w;
+    lx->marked = true;
+    return true;
+}
+
+// A redirection operator at p, after an optional fd number.
+static const char *lex_redir(Lexer *lx, const char *p, int fd) {
+    lx->type = T_REDIR;
+    lx->rfd = fd >= 0 ? fd : p[0] == '<' ? 0 : 1;
+    if (p[0] == '<') {
+        if (p[1] == '<' && p[2] == '<') { lx->rkind = R_HERESTR; return p + 3; }
+        if (p[1] == '<') { lx->rkind = R_HEREDOC; return p + (p[2] == '-' ? 3 : 2); }
+        lx->rkind = p[1] == '&' ? R_DUP : p[1] == '>' ? R_RDWR : R_IN;
+        return p + (lx->rkind == R_IN ? 1 : 2);
+    }
+    if (p[1] == '>') { lx->rkind = R_APPEND; return p + 2; }
+    lx->rkind = p[1] == '&' ? R_DUP : R_OUT;
+    return p + (p[1] == '&' || p[1] == '|' ? 2 : 1);
+}
+
+// The bodies of the here-docs opened on the line just ended, which start
+// at p. Without a quoted delimiter a body gets $ and ` expansions, as if
+// in double quotes (but the quotes themselves are plain characters).
+static const char *lex_heredocs(Lexer *lx, const char *p) {
+    for (Redir *r = lx->hd; r; r = r->hd_next) {
+        const char *delim = r->word;
+        size_t dl = strlen(delim);
+        char *w = r->word = lx->w;
+        for (;;) {
+            if (r->strip) while (*p == '\t') p++;
+            if (strncmp(p, delim, dl) == 0 && (p[dl] == '\n' || !p[dl])) { p += dl + (p[dl] == '\n'); break; }
+            if (!*p) {   // leave r and the rest waiting, delimiters intact
+                r->word = (char *)delim;
+                lx->hd = r;
+                lx->type = T_ERROR; lx->quote = '<';
+                return p;
+            }
+            while (*p && *p != '\n') {
+                if (r->literal) *w++ = *p++;
+                else if (*p == '\\' && p[1] && strchr("$`\\\n", p[1])) {
+                    if (p[1] != '\n') *w++ = p[1];
+                    p += 2;
+                } else if (*p == '$') {
+                    if (!lex_dollar(lx, &p, &w, CTL_QVAR)) return p;
+                } else if (*p == '`') {
+                    if (!lex_backtick(lx, &p, &w, CTL_QCMD)) return p;
+                } else *w++ = *p++;
+            }
+            if (*p) *w++ = *p++;
+        }
+        *w++ = '\0';
+        lx->w = w;
+    }
+    lx->hd = NULL;
+    lx->hd_tail = &lx->hd;
+    return p;
+}
+
+static void lex_next(Lexer *lx) {
+    const char *p = lx->p;
+    for (;;) {
+        while (*p==' ' || *p=='\t') p++;
+        if (p[0] == '\\' && p[1] == '\n') p += 2;   // backslash-newline joins lines
+        else break;
+    }
+    if (*p == '#') p += strcspn(p, "\n");   // comment to end of line
+    lx->tok = p;
+    lx->word = NULL;
+    lx->marked = false;
+    switch (*p) {
+    case '\0':
+        lx->type = T_END;
+        if (lx->hd) { lx->type = T_ERROR; lx->quote = '<'; }   // a here-doc still wants its body
+        break;
+    case '\n':
+        lx->type = T_NL;
+        p++;
+        if (lx->hd) { p = lex_heredocs(lx, p); if (lx->type == T_ERROR) return; }
+        break;
+    case '|':  if (p[1]=='|') { lx->type = T_OR;  p++; } else lx->type = T_PIPE; p++; break;
+    case '&':
+        if (p[1]=='&') { lx->type = T_AND; p += 2; }
+        else if (p[1]=='>') { p = lex_redir(lx, p+1, -1); lx->rfd = -2; }   // &> and &>>: both
+        else { lx->type = T_AMP; p++; }
+        break;
+    case '>': case '<': p = lex_redir(lx, p, -1); break;
+    case ';':  lx->type = T_SEMI;   p++; break;
+    case '(':  lx->type = T_LPAREN; p++; break;
+    case ')':  lx->type = T_RPAREN; p++; break;
+    default: {
+        if (isdigit((unsigned char)p[0]) && (p[1] == '<' || p[1] == '>')) {   // 2>file, 0<&3
+            p = lex_redir(lx, p + 1, p[0] - '0');
+            break;
+        }
+        char *w = lx->word = lx->w;
+        while (*p && !is_meta(*p)) {
+            if (*p == '\\') {
+                if (p[1] && p[1] != '\n') *w++ = p[1];   // backslash-newline joins lines
+                p += p[1] ? 2 : 1;
+            } else if (*p == '\'') {
+                const char *e = strchr(p+1, '\'');
+                if (!e) { lx->type = T_ERROR; lx->quote = '\''; return; }
+                memcpy(w, p+1, (size_t)(e-p-1)); w += e-p-1;
+                if (e == p+1) { *w++ = CTL_QUOTE; lx->marked = true; }
+                p = e+1;
+            } else if (*p == '"') {
+                char *start = w;
+                for (p++; *p && *p != '"'; ) {
+                    if (*p == '\\' && p[1] && strchr("$`\"\\\n", p[1])) {
+                        if (p[1] != '\n') *w++ = p[1];
+                        p += 2;
+                    } else if (*p == '$') {
+                        if (!lex_dollar(lx, &p, &w, CTL_QVAR)) return;
+                    } else if (*p == '`') {
+                        if (!lex_backtick(lx, &p, &w, CTL_QCMD)) return;
+                    } else *w++ = *p++;
+                }
+                if (!*p) { lx->type = T_ERROR; lx->quote = '"'; return; }
+                if (w == start) { *w++ = CTL_QUOTE; lx->marked = true; }
+                p++;
+            } else if (*p == '$') {
+                if (!lex_dollar(lx, &p, &w, CTL_VAR)) return;
+            } else if (*p == '`') {
+                if (!lex_backtick(lx, &p, &w, CTL_CMD)) return;
+            } else *w++ = *p++;
+        }
+        *w++ = '\0';
+        lx->w = w;
+        lx->type = T_WORD;
+    }
+    }
+    lx->p = p;
+}
+
+static int syntax_error(const Lexer *lx) {
+    if (lx->type == T_ERROR && !lx->quote) fprintf(stderr, "mysh: bad substitution\n");
+    else if (lx->type == T_ERROR && lx->quote == '<') fprintf(stderr, "mysh: unexpected end of file in here-document\n");
+    else if (lx->type == T_ERROR) fprintf(stderr, "mysh: unexpected EOF while looking for matching `%c'\n", lx->quote);
+    else fprintf(stderr, "mysh: syntax error near unexpected token `%s'\n", tok_text(lx));
+    return -1;
+}
+
+// Recursive descent over the lexer, everything allocated from a. With
+// more set, input that stops mid-construct (an open quote, an if without
+// its fi, a trailing |) is not an error but a request for another line.
+#define PARSE_MORE (-2)
+
+typedef struct {
+    Arena *a;
+    Lexer  lx;
+    bool   more;
+    int    rc;        // 0, -1 once an error is reported, or PARSE_MORE
+    int    depth;     // compound commands open
+} Parser;
+
+// After PARSE_MORE, what a later line must have before the construct can
+// end, so a long body isn't parsed again from the top for every line of
+// it: a closing quote, here-doc delimiters, or a closing reserved word.
+static struct {
+    char  quote;      // the unclosed ' " ` ) or }
+    bool  keyword;    // inside a compound command: fi, done or }
+    char *delims;     // here-doc delimiters, each ending in '\n'; malloc'd
+} parse_wait;
+
+static const char *const reserved_stops[] = { "then", "else", "elif", "fi", "do", "done", "}", NULL };
+
+static void note_wait(const Parser *ps) {
+    const Lexer *lx = &ps->lx;
+    free(parse_wait.delims);
+    parse_wait.delims = NULL;
+    parse_wait.quote = lx->type == T_ERROR && lx->quote != '<' ? lx->quote : 0;
+    parse_wait.keyword = lx->type == T_END && ps->depth > 0;
+    if (lx->type != T_ERROR || lx->quote != '<') return;
+    size_t len = 1;
+    for (const Redir *r = lx->hd; r; r = r->hd_next) len += strlen(r->word) + 1;
+    char *d = parse_wait.delims = malloc(len);
+    if (!d) return;   // no hint: every line gets parsed
+    for (const Redir *r = lx->hd; r; r = r->hd_next) d += sprintf(d, "%s\n", r->word);
+}
+
+static Node *parse_fail(Parser *ps) {
+    if (ps->rc) return NULL;
+    bool at_end = ps->lx.type == T_END || (ps->lx.type == T_ERROR && ps->lx.quote);
+    if (ps->more && at_end) { ps->rc = PARSE_MORE; note_wait(ps); }
+    else ps->rc = syntax_error(&ps->lx);
+    return NULL;
+}
+
+static bool word_char(char c) { return isalnum((unsigned char)c) || c == '_'; }
+
+// Whether line could end what parse_wait says is open; when unsure, yes.
+static bool line_may_close(const char *line) {
+    if (parse_wait.delims) {
+        const char *l = line + strspn(line, "\t");   // <<- strips tabs
+        size_t n = strlen(l);
+        for (const char *d = parse_wait.delims; *d; d += strcspn(d, "\n") + 1)
+            if (strcspn(d, "\n") == n && strncmp(d, l, n) == 0) return true;
+        return false;
+    }
+    if (parse_wait.quote) return strchr(line, parse_wait.quote) != NULL;
+    if (!parse_wait.keyword) return true;
+    if (strchr(line, '}')) return true;
+    for (const char *p = line; *p; p++) {
+        if (p > line && word_char(p[-1])) continue;
+        if ((strncmp(p, "fi", 2) == 0 && !word_char(p[2])) || (strncmp(p, "done", 4) == 0 && !word_char(p[4])))
+            return true;
+    }
+    return false;
+}
+
+// A reserved word counts only unquoted and in command position.
+static bool at_kw(const Parser *ps, const char *kw) {
+    const Lexer *lx = &ps->lx;
+    size_t n = strlen(kw);
+    return lx->type == T_WORD && !lx->marked && (size_t)(lx->p - lx->tok) == n && strncmp(lx->tok, kw, n) == 0;
+}
+
+static bool at_any_kw(const Parser *ps, const char *const *kws) {
+    for (; kws && *kws; kws++) if (at_kw(ps, *kws)) return true;
+    return false;
+}
+
+static bool expect_kw(Parser *ps, const char *kw) {
+    if (!at_kw(ps, kw)) { parse_fail(ps); return false; }
+    lex_next(&ps->lx);
+    return true;
+}
+
+static void skip_nl(Parser *ps) {
+    while (ps->lx.type == T_NL) lex_next(&ps->lx);
+}
+
+static Node *new_node(Parser *ps, node_kind kind) {
+    Node *n = arena_zalloc(ps->a, sizeof(Node));
+    n->kind = kind;
+    return n;
+}
+
+static char *span_copy(Arena *a, const char *from, const char *to) {
+    while (to > from && (to[-1] == ' ' || to[-1] == '\t' || to[-1] == '\n')) to--;
+    char *s = arena_alloc(a, (size_t)(to - from) + 1);
+    memcpy(s, from, (size_t)(to - from));
+    s[to - from] = '\0';
+    return s;
+}
+
+static Node *parse_list(Parser *ps, const char *const *stops);
+
+// The body of a compound command, which must not be empty.
+static Node *parse_body(Parser *ps, const char *const *stops) {
+    Node *n = parse_list(ps, stops);
+    if (!n && !ps->rc) parse_fail(ps);
+    return n;
+}
+
+// After `if` or `elif`: through the closing fi.
+static Node *parse_if(Parser *ps) {
+    static const char *const then[] = { "then", NULL }, *const rest[] = { "elif", "else", "fi", NULL },
+                             *const fi[] = { "fi", NULL };
+    Node *n = new_node(ps, N_IF);
+    if (!(n->cond = parse_body(ps, then)) || !expect_kw(ps, "then")) return NULL;
+    if (!(n->body = parse_body(ps, rest))) return NULL;
+    if (at_kw(ps, "elif")) {
+        lex_next(&ps->lx);
+        return (n->orelse = parse_if(ps)) ? n : NULL;
+    }
+    if (at_kw(ps, "else")) {
+        lex_next(&ps->lx);
+        if (!(n->orelse = parse_body(ps, fi))) return NULL;
+    }
+    return expect_kw(ps, "fi") ? n : NULL;
+}
+
+static Node *parse_compound_body(Parser *ps) {
+    static const char *const do_[] = { "do", NULL }, *const done[] = { "done", NULL },
+                             *const brace[] = { "}", NULL };
+    Lexer *lx = &ps->lx;
+    if (at_kw(ps, "if")) { lex_next(lx); return parse_if(ps); }
+    if (at_kw(ps, "while") || at_kw(ps, "until")) {
+        Node *n = new_node(ps, at_kw(ps, "while") ? N_WHILE : N_UNTIL);
+        lex_next(lx);
+        if (!(n->cond = parse_body(ps, do_)) || !expect_kw(ps, "do")) return NULL;
+        if (!(n->body = parse_body(ps, done)) || !expect_kw(ps, "done")) return NULL;
+        return n;
+    }
+    if (at_kw(ps, "for")) {
+        Node *n = new_node(ps, N_FOR);
+        lex_next(lx);
+        if (lx->type != T_WORD || lx->marked || name_len(lx->word) != strlen(lx->word)) return parse_fail(ps);
+        n->var = lx->word;
+        lex_next(lx);
+        skip_nl(ps);
+        if (at_kw(ps, "in")) {
+            lex_next(lx);
+            size_t nw = 0;
+            n->words = arena_alloc(ps->a, sizeof(char *));
+            while (lx->type == T_WORD) {
+                n->words = arena_realloc(ps->a, n->words, (nw+1) * sizeof(char *), (nw+2) * sizeof(char *));
+                n->words[nw++] = lx->word;
+                lex_next(lx);
+            }
+            n->words[nw] = NULL;
+            if (lx->type != T_SEMI && lx->type != T_NL) return parse_fail(ps);
+            lex_next(lx);
+        } else if (lx->type == T_SEMI) lex_next(lx);
+        skip_nl(ps);
+        if (!expect_kw(ps, "do")) return NULL;
+        if (!(n->body = parse_body(ps, done)) || !expect_kw(ps, "done")) return NULL;
+        return n;
+    }
+    lex_next(lx);   // {
+    Node *n = parse_body(ps, brace);
+    return n && expect_kw(ps, "}") ? n : NULL;
+}
+
+static Node *parse_compound(Parser *ps) {
+    ps->depth++;
+    Node *n = parse_compound_body(ps);
+    ps->depth--;
+    return n;
+}
+
+static bool at_compound(const Parser *ps) {
+    static const char *const kws[] = { "if", "while", "until", "for", "{", NULL };
+    return at_any_kw(ps, kws);
+}
+
+// name() compound, from the ( on. The body's source is kept so the
+// definition can be parsed again into storage of its own.
+static Node *parse_funcdef(Parser *ps, char *name) {
+    Lexer *lx = &ps->lx;
+    lex_next(lx);
+    if (lx->type != T_RPAREN) return parse_fail(ps);
+    lex_next(lx);
+    skip_nl(ps);
+    if (!at_compound(ps)) return parse_fail(ps);
+    Node *n = new_node(ps, N_FUNCDEF);
+    n->name = name;
+    const char *from = lx->tok;
+    if (!(n->body = parse_compound(ps))) return NULL;
+    n->src = span_copy(ps->a, from, lx->tok);
+    return n;
+}
+
+// One redirection, operator and word, linked in at *tail. Returns the new
+// tail, or NULL after a syntax error.
+static Redir **parse_redir(Parser *ps, Command *cmd, Redir **tail) {
+    Lexer *lx = &ps->lx;
+    redir_kind kind = lx->rkind;
+    int fd = lx->rfd;
+    bool strip = kind == R_HEREDOC && lx->p[-1] == '-';
+    lex_next(lx);
+    if (lx->type != T_WORD) { parse_fail(ps); return NULL; }
+    Redir *r = arena_zalloc(ps->a, sizeof(Redir));
+    r->kind = kind;
+    r->fd = fd < 0 ? 1 : fd;
+    r->word = lx->word;
+    r->strip = strip;
+    if (kind == R_HEREDOC) {   // the body comes after the line: queue it
+        for (const char *q = lx->tok; q < lx->p && !r->literal; q++) r->literal = *q == '\'' || *q == '"' || *q == '\\';
+        *lx->hd_tail = r;
+        lx->hd_tail = &r->hd_next;
+        cmd->expand |= !r->literal;
+    } else cmd->expand |= lx->marked;
+    *tail = r;
+    tail = &r->next;
+    if (fd == -2) {   // &>
+        Redir *e = arena_zalloc(ps->a, sizeof(Redir));
+        *e = (Redir){ .kind = R_DUP, .fd = 2, .word = "1" };
+        *tail = e;
+        tail = &e->next;
+    }
+    lex_next(lx);
+    return tail;
+}
+
+static Command *parse_command(Parser *ps) {
+    Arena *a = ps->a;
+    Lexer *lx = &ps->lx;
+    Command *cmd = arena_zalloc(a, sizeof(Command));
+    size_t argc = 0, arg_cap = 8, nassign = 0;
+    cmd->argv = arena_alloc(a, arg_cap * sizeof(char *));
+    Redir **rtail = &cmd->redirs;
+    int items = 0;
+    if (at_any_kw(ps, reserved_stops)) { parse_fail(ps); return NULL; }
+    if (at_compound(ps)) {
+        if (!(cmd->body = parse_compound(ps))) return NULL;
+        items++;
+    }
+    for (;; items++) {
+        if (lx->type == T_WORD && cmd->body) break;   // only redirections after a compound
+        if (lx->type == T_WORD) cmd->expand |= lx->marked;
+        if (lx->type == T_WORD && argc == 0 && !cmd->pin && name_len(lx->word) && lx->word[name_len(lx->word)] == '=') {
+            cmd->assign = arena_realloc(a, cmd->assign, nassign * sizeof(char *), (nassign+2) * sizeof(char *));
+            cmd->assign[nassign++] = lx->word;
+            cmd->assign[nassign] = NULL;
+            cmd->expand = true;
+        } else if (lx->type == T_WORD && argc == 0 && !cmd->pin && strcmp(lx->word, "pin") == 0) {
+            lex_next(lx);
+            if (lx->type != T_WORD) { parse_fail(ps); return NULL; }
+            cmd->pin = lx->word;
+            cmd->expand |= lx->marked;
+        } else if (lx->type == T_WORD) {
+            if (argc+1 == arg_cap) {
+                cmd->argv = arena_realloc(a, cmd->argv, arg_cap * sizeof(char *), arg_cap*2 * sizeof(char *));
+                arg_cap *= 2;
+            }
+            cmd->argv[argc++] = lx->word;
+        } else if (lx->type == T_LPAREN && argc == 1 && !nassign && !cmd->pin && !cmd->expand &&
+                   name_len(cmd->argv[0]) == strlen(cmd->argv[0])) {
+            if (!(cmd->body = parse_funcdef(ps, cmd->argv[0]))) return NULL;
+            argc = 0;
+            break;
+        } else if (lx->type == T_REDIR) {
+            if (!(rtail = parse_redir(ps, cmd, rtail))) return NULL;
+            continue;
+        } else break;
+        lex_next(lx);
+    }
+    cmd->argv[argc] = NULL;
+    if (!items) { parse_fail(ps); return NULL; }
+    return cmd;
+}
+
+static Node *parse_pipeline(Parser *ps) {
+    Lexer *lx = &ps->lx;
+    const char *from = lx->tok;
+    Pipeline *pl = arena_zalloc(ps->a, sizeof(Pipeline));
+    if (at_kw(ps, "time")) { pl->timed = true; lex_next(lx); }
+    if (at_kw(ps, "!")) { pl->negate = true; lex_next(lx); }
+    size_t cmd_cap = 0;
+    for (;;) {
+        Command *cmd = parse_command(ps);
+        if (!cmd) return NULL;
+        if ((size_t)pl->ncmds == cmd_cap) {
+            pl->cmds = arena_realloc(ps->a, pl->cmds, cmd_cap * sizeof(Command *), (cmd_cap ? cmd_cap*2 : 4) * sizeof(Command *));
+            cmd_cap = cmd_cap ? cmd_cap*2 : 4;
+        }
+        pl->cmds[pl->ncmds++] = cmd;
+        pl->expand |= cmd->expand;
+        if (lx->type != T_PIPE) break;
+        lex_next(lx);
+        skip_nl(ps);
+    }
+    Node *n = new_node(ps, N_PIPELINE);
+    n->pl = pl;
+    n->text = span_copy(ps->a, from, lx->tok);
+    return n;
+}
+
+// Pipelines joined by && and ||, which bind equally, left to right.
+static Node *parse_and_or(Parser *ps) {
+    Lexer *lx = &ps->lx;
+    Node *n = parse_pipeline(ps);
+    while (n && (lx->type == T_AND || lx->type == T_OR)) {
+        Node *op = new_node(ps, lx->type == T_AND ? N_AND : N_OR);
+        lex_next(lx);
+        skip_nl(ps);
+        op->cond = n;
+        if (!(op->body = parse_pipeline(ps))) return NULL;
+        n = op;
+    }
+    return n;
+}
+
+// `a && b &` runs the whole of it in the background: a forked stage with
+// the and-or list as its body.
+static Node *background_node(Parser *ps, Node *n, const char *text) {
+    if (n->kind != N_PIPELINE) {
+        Command *cmd = arena_zalloc(ps->a, sizeof(Command));
+        cmd->argv = arena_zalloc(ps->a, sizeof(char *));
+        cmd->body = n;
+        Pipeline *pl = arena_zalloc(ps->a, sizeof(Pipeline));
+        pl->cmds = arena_alloc(ps->a, sizeof(Command *));
+        pl->cmds[pl->ncmds++] = cmd;
+        n = new_node(ps, N_PIPELINE);
+        n->pl = pl;
+    }
+    n->pl->background = true;
+    n->text = text;
+    return n;
+}
+
+// And-or lists separated by ';', '&' or newlines, up to the end of input
+// or one of stops in command position. NULL, without error, if there are
+// none.
+static Node *parse_list(Parser *ps, const char *const *stops) {
+    Lexer *lx = &ps->lx;
+    Node *list = NULL, *first = NULL;
+    size_t kids_cap = 0;
+    skip_nl(ps);
+    while (lx->type != T_END && !at_any_kw(ps, stops)) {
+        const char *from = lx->tok;
+        Node *item = parse_and_or(ps);
+        if (!item) return NULL;
+        if (lx->type == T_AMP) item = background_node(ps, item, span_copy(ps->a, from, lx->tok + 1));
+        if (!first) first = item;
+        else {
+            if (!list) {
+                list = new_node(ps, N_LIST);
+                list->kids = arena_alloc(ps->a, 4 * sizeof(Node *));
+                kids_cap = 4;
+                list->kids[list->nkids++] = first;
+            }
+            if ((size_t)list->nkids == kids_cap) {   // doubling: a long body is copied log n times
+                list->kids = arena_realloc(ps->a, list->kids, kids_cap * sizeof(Node *), kids_cap * 2 * sizeof(Node *));
+                kids_cap *= 2;
+            }
+            list->kids[list->nkids++] = item;
+        }
+        if (lx->type == T_AMP || lx->type == T_SEMI || lx->type == T_NL) lex_next(lx);
+        else break;
+        skip_nl(ps);
+    }
+    return list ? list : first;
+}
+
+// Parse src into a tree allocated from a. Returns 0 with *out set (NULL
+// for nothing but blanks and comments), -1 after reporting a syntax
+// error, or, when more is set, PARSE_MORE if src stops mid-construct.
+static int parse_line(Arena *a, const char *src, Node **out, bool more) {
+    *out = NULL;
+    // a word is at most its source plus a NUL, or half again for $x
+    // markers; twice the source covers both
+    Parser ps = { .a = a, .more = more, .lx = { .p = src, .w = arena_alloc(a, strlen(src)*2 + 1) } };
+    ps.lx.hd_tail = &ps.lx.hd;
+    lex_next(&ps.lx);
+    Node *n = parse_list(&ps, NULL);
+    if (!ps.rc && ps.lx.type != T_END) parse_fail(&ps);
+    if (ps.rc) return ps.rc;
+    *out = n;
+    return 0;
+}
+
+// ---------- expansion ----------
+// Turning a parsed command's markers into values, in the line's arena. A
+// command without markers or assignments is used as parsed.
+typedef struct {
+    Arena  *a;
+    char  **v;          // fields so far
+    size_t  n, cap;
+    bool    split;      // unquoted values split on IFS
+    const char *ifs;
+    bool    has;        // the current field exists, even if empty
+} Expander;
+
+static char  *xbuf = NULL;   // the field being built
+static size_t xlen = 0, xcap = 0;
+
+static char *command_output(Arena *a, const char *src, size_t n);   // command substitution
+
+static void x_put(const char *s, size_t n) {
+    if (xlen + n + 1 > xcap) {
+        while (xlen + n + 1 > xcap) xcap = xcap ? xcap*2 : 256;
+        xbuf = realloc(xbuf, xcap);
+    }
+    memcpy(xbuf + xlen, s, n);
+    xlen += n;
+}
+
+static void x_field(Expander *x) {
+    if (x->n + 2 > x->cap) {
+        size_t cap = x->cap ? x->cap*2 : 8;
+        x->v = arena_realloc(x->a, x->v, x->cap * sizeof(char *), cap * sizeof(char *));
+        x->cap = cap;
+    }
+    char *f = arena_alloc(x->a, xlen + 1);
+    memcpy(f, xbuf, xlen);
+    f[xlen] = '\0';
+    x->v[x->n++] = f;
+    x->v[x->n] = NULL;
+    xlen = 0;
+    x->has = false;
+}
+
+static void x_value(Expander *x, const char *val, bool quoted) {
+    if (quoted || !x->split) { x_put(val, strlen(val)); x->has = true; return; }
+    for (; *val; val++) {
+        if (strchr(x->ifs, *val)) { if (x->has) x_field(x); }
+        else { x_put(val, 1); x->has = true; }
+    }
+}
+
+// The value of a special or named parameter; num is scratch for numbers.
+static const char *x_param(const char *name, size_t n, char *num, size_t numsz) {
+    if (isdigit((unsigned char)*name)) return *name - '0' < npos_args ? pos_args[*name - '0'] : NULL;
+    if (n == 1 && *name == '#') { snprintf(num, numsz, "%d", npos_args ? npos_args - 1 : 0); return num; }
+    if (n == 1 && *name == '$') { snprintf(num, numsz, "%d", (int)shell_pid); return num; }
+    if (n == 1 && *name == '?') { snprintf(num, numsz, "%d", last_status); return num; }
+    Var *v = var_find(name, n);
+    return v && v->kv ? v->kv + n + 1 : NULL;
+}
+
+static void expand_into(Expander *x, const char *w) {
+    xlen = 0;
+    x->has = false;
+    for (const char *p = w; *p; ) {
+        if (*p == CTL_QUOTE) { x->has = true; p++; continue; }
+        if (*p == CTL_CMD || *p == CTL_QCMD) {
+            bool quoted = *p == CTL_QCMD;
+            const char *src = ++p;
+            p = strchr(p, CTL_END);
+            size_t n = (size_t)(p++ - src);
+            // the running command may expand words of its own
+            size_t saved = xlen;
+            char *field = arena_alloc(x->a, saved + 1);
+            memcpy(field, xbuf, saved);
+            char *out = command_output(x->a, src, n);
+            xlen = 0;
+            x_put(field, saved);
+            x_value(x, out, quoted);
+            continue;
+        }
+        if (*p != CTL_VAR && *p != CTL_QVAR) {
+            size_t n = strcspn(p, "\x01\x02\x04\x05\x06");
+            x_put(p, n);
+            x->has = true;
+            p += n;
+            continue;
+        }
+        bool quoted = *p == CTL_QVAR;
+        const char *name = ++p;
+        p = strchr(p, CTL_END);
+        size_t n = (size_t)(p++ - name);
+        if (*name == '@' || *name == '*') {
+            // "$@" is one field per argument; the rest join with spaces
+            for (int k=1;k<npos_args;k++) {
+                if (k > 1) {
+                    if (quoted && *name == '@' && x->split) x_field(x);
+                    else x_value(x, " ", quoted);
+                }
+                x_value(x, pos_args[k], quoted);
+            }
+            continue;
+        }
+        char num[24];
+        const char *val = x_param(name, n, num, sizeof(num));
+        if (val) x_value(x, val, quoted);
+    }
+    if (x->has) x_field(x);
+}
+
+// One word, unsplit: redirection targets, assignments, pin.
+static char *expand_word(Arena *a, const char *w) {
+    Expander x = { .a = a };
+    expand_into(&x, w);
+    return x.n ? x.v[0] : "";
+}
+
+// The environment for a command with NAME=value prefixes: ours with
+// those laid over it.
+static char **env_with(Arena *a, char **assign) {
+    size_t n = 0;
+    while (assign[n]) n++;
+    char **e = arena_alloc(a, sizeof(char *) * (nenv + n + 1));
+    memcpy(e, shell_envp, sizeof(char *) * nenv);
+    size_t m = nenv;
+    for (size_t i=0;i<n;i++) {
+        size_t nl = strcspn(assign[i], "=") + 1;
+        size_t k = 0;
+        while (k < m && strncmp(e[k], assign[i], nl) != 0) k++;
+        e[k] = assign[i];
+        if (k == m) m++;
+    }
+    e[m] = NULL;
+    return e;
+}
+
+static Command *expand_command(Arena *a, Command *c) {
+    if (!c->expand) return c;
+    Command *x = arena_alloc(a, sizeof(Command));
+    *x = *c;
+    const char *ifs = var_get("IFS");
+    Expander ex = { .a = a, .split = true, .ifs = ifs ? ifs : " \t\n" };
+    for (char **w = c->argv; *w; w++) expand_into(&ex, *w);
+    x->argv = ex.n ? ex.v : arena_zalloc(a, sizeof(char *));
+    if (c->pin) x->pin = expand_word(a, c->pin);
+    for (Redir *r = c->redirs, **tail = &x->redirs; r; r = r->next) {
+        Redir *xr = arena_alloc(a, sizeof(Redir));
+        *xr = *r;
+        if (!r->literal) xr->word = expand_word(a, r->word);
+        *tail = xr;
+        tail = &xr->next;
+    }
+    if (c->assign) {
+        size_t n = 0;
+        while (c->assign[n]) n++;
+        x->assign = arena_alloc(a, sizeof(char *) * (n + 1));
+        for (size_t i=0;i<n;i++) {
+            size_t nl = strcspn(c->assign[i], "=") + 1;
+            char *val = expand_word(a, c->assign[i] + nl);
+            size_t vl = strlen(val);
+            char *kv = arena_alloc(a, nl + vl + 1);
+            memcpy(kv, c->assign[i], nl);
+            memcpy(kv + nl, val, vl + 1);
+            x->assign[i] = kv;
+        }
+        x->assign[n] = NULL;
+        if (x->argv[0]) x->envp = env_with(a, x->assign);
+    }
+    return x;
+}
+
+// Prefixes on a builtin run by the shell itself hold for that builtin:
+// set them, and afterwards put back what was there.
+static char **assign_push(Arena *a, char **assign) {
+    size_t n = 0;
+    while (assign[n]) n++;
+    char **saved = arena_alloc(a, sizeof(char *) * (n + 1));
+    for (size_t i=0;i<n;i++) {
+        size_t nl = strcspn(assign[i], "=");
+        char *name = arena_alloc(a, nl + 1);
+        memcpy(name, assign[i], nl);
+        name[nl] = '\0';
+        Var *v = var_find(name, nl);
+        saved[i] = NULL;
+        if (v && v->kv) {
+            saved[i] = arena_alloc(a, strlen(v->kv) + 2);
+            saved[i][0] = v->exported ? 'x' : '-';
+            strcpy(saved[i] + 1, v->kv);
+        }
+        var_set(name, assign[i] + nl + 1, true);
+    }
+    saved[n] = NULL;
+    return saved;
+}
+
+static void assign_pop(Arena *a, char **assign, char **saved) {
+    for (size_t i=0;assign[i];i++) {
+        size_t nl = strcspn(assign[i], "=");
+        char *name = arena_alloc(a, nl + 1);
+        memcpy(name, assign[i], nl);
+        name[nl] = '\0';
+        var_unset(name);
+        if (saved[i]) var_set(name, saved[i] + nl + 2, saved[i][0] == 'x');
+    }
+}
+
+// ---------- self-timing ----------
+// Where the shell's own time goes. Each phase has a log-linear histogram
+// (HDR style: 32 sub-buckets per power of two, about 3% resolution), so
+// recording is a clock read and an increment. shellstat prints them, and
+// MYSH_TRACE=N sends one JSON line per event to fd N as well.
+//   parse    parse_line, per line
+//   launch   fork or posix_spawn, per stage
+//   exit     a foreground pipeline's first launch to its last exit
+//   wait     the shell blocked waiting for it
+//   prompt   rendering and drawing the prompt
+//   line     a whole line, parse to the next prompt; line minus exit is
+//            what the shell itself cost
+typedef enum { ST_PARSE, ST_LAUNCH, ST_EXIT, ST_WAIT, ST_PROMPT, ST_LINE, NSTATS } stat_kind;
+static const char *const stat_names[NSTATS] = { "parse", "launch", "exit", "wait", "prompt", "line" };
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP  42     // 2^42ns is over an hour; anything longer counts there
+#define HIST_BUCKETS  ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+
+typedef struct {
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long n, sum, min, max;   // ns
+} Histogram;
+
+static Histogram stats[NSTATS];
+static int trace_fd = -1;    // MYSH_TRACE, moved out of the way of redirections
+
+static long long mono_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+// Values below HIST_SUB get a bucket each; above, the top HIST_SUB_BITS+1
+// bits pick one.
+static int hist_bucket(unsigned long long v) {
+    if (v < HIST_SUB) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    if (e > HIST_MAX_EXP) { e = HIST_MAX_EXP; v = (2ULL << e) - 1; }
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// The lowest value that lands in bucket i.
+static unsigned long long hist_bucket_low(int i) {
+    if (i < HIST_SUB) return (unsigned long long)i;
+    int e = i / HIST_SUB + HIST_SUB_BITS - 1;
+    return (unsigned long long)(HIST_SUB + i % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+static void stat_record(stat_kind k, long long ns) {
+    Histogram *h = &stats[k];
+    unsigned long long v = ns > 0 ? (unsigned long long)ns : 0;
+    h->counts[hist_bucket(v)]++;
+    if (!h->n || v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+    h->n++;
+    h->sum += v;
+}
+
+// The value at or below which a fraction q of the samples fall: the
+// highest value of its bucket, as HDR reports it.
+static unsigned long long hist_quantile(const Histogram *h, double q) {
+    unsigned long long want = (unsigned long long)(q * (double)h->n + 0.999999), seen = 0;
+    if (!want) want = 1;
+    for (int i=0;i<HIST_BUCKETS;i++) {
+        if ((seen += h->counts[i]) < want) continue;
+        unsigned long long hi = i + 1 < HIST_BUCKETS ? hist_bucket_low(i + 1) - 1 : h->max;
+        return hi < h->max ? (hi > h->min ? hi : h->min) : h->max;
+    }
+    return h->max;
+}
+
+static void trace_init() {
+    const char *v = var_get("MYSH_TRACE");
+    if (!v || !*v) return;
+    char *end;
+    long fd = strtol(v, &end, 10);
+    if (*end || fd < 0 || fd > INT_MAX || fcntl((int)fd, F_GETFD) < 0) {
+        fprintf(stderr, "mysh: MYSH_TRACE=%s: not an open descriptor\n", v);
+        return;
+    }
+    trace_fd = fcntl((int)fd, F_DUPFD_CLOEXEC, REDIR_FDS);
+    if (trace_fd >= 0 && fd > 2) close((int)fd);
+}
+
+// s as a JSON string, cut to fit in n bytes.
+static size_t json_str(char *out, size_t n, const char *s) {
+    size_t k = 0;
+    out[k++] = '"';
+    for (; *s && k + 8 < n; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') { out[k++] = '\\'; out[k++] = (char)c; }
+        else if (c < 0x20) k += (size_t)snprintf(out + k, n - k, "\\u%04x", c);
+        else out[k++] = (char)c;
+    }
+    out[k++] = '"';
+    out[k] = '\0';
+    return k;
+}
+
+// One event: a record of "key":number pairs, plus the command if any.
+// One write each, so a pipe reader never sees half a line.
+static void trace_event(const char *ev, const char *cmd, const char *fields, ...) {
+    if (trace_fd < 0) return;
+    char buf[1024];
+    int len = snprintf(buf, sizeof(buf), "{\"ev\":\"%s\",\"t\":%lld", ev, mono_ns());
+    va_list ap;
+    va_start(ap, fields);
+    for (const char *f = fields; *f; f += strcspn(f, ",") + (f[strcspn(f, ",")] == ',')) {
+        int fl = (int)strcspn(f, ",");
+        len += snprintf(buf + len, sizeof(buf) - (size_t)len, ",\"%.*s\":%lld", fl, f, va_arg(ap, long long));
+    }
+    va_end(ap);
+    if (cmd) {
+        len += snprintf(buf + len, sizeof(buf) - (size_t)len, ",\"cmd\":");
+        len += (int)json_str(buf + len, sizeof(buf) - (size_t)len - 3, cmd);
+    }
+    len += snprintf(buf + len, sizeof(buf) - (size_t)len, "}\n");
+    (void)!write(trace_fd, buf, (size_t)len);
+}
+
+static void fmt_ns(char *buf, size_t n, unsigned long long ns) {
+    if (ns < 1000) snprintf(buf, n, "%lluns", ns);
+    else if (ns < 1000000) snprintf(buf, n, "%.1fus", (double)ns / 1e3);
+    else if (ns < 1000000000) snprintf(buf, n, "%.1fms", (double)ns / 1e6);
+    else snprintf(buf, n, "%.2fs", (double)ns / 1e9);
+}
+
+// shellstat       the phases since start (or the last reset)
+// shellstat -r    reset
+static int builtin_shellstat(char **argv) {
+    if (argv[1] && strcmp(argv[1], "-r") == 0) { memset(stats, 0, sizeof(stats)); return 0; }
+    if (argv[1]) { fprintf(stderr, "shellstat [-r]\n"); return -1; }
+    static const double qs[] = { 0.5, 0.9, 0.99 };
+    printf("%-8s %9s %9s %9s %9s %9s %9s\n", "phase", "count", "mean", "p50", "p90", "p99", "max");
+    for (int k=0;k<NSTATS;k++) {
+        const Histogram *h = &stats[k];
+        char col[5][16];
+        fmt_ns(col[0], sizeof(col[0]), h->n ? h->sum / h->n : 0);
+        for (int q=0;q<3;q++) fmt_ns(col[q+1], sizeof(col[q+1]), h->n ? hist_quantile(h, qs[q]) : 0);
+        fmt_ns(col[4], sizeof(col[4]), h->max);
+        printf("%-8s %9llu %9s %9s %9s %9s %9s\n", stat_names[k], h->n, col[0], col[1], col[2], col[3], col[4]);
+    }
+    return 0;
+}
+
+// ---------- cwd and prompt ----------
+// The shell keeps its logical working directory itself, the way sh does
+// for PWD: cd updates it, so neither pwd nor the prompt has to ask the
+// kernel, however deep (or remote) the path.
+static char *shell_pwd = NULL;
+
+// Trust an inherited PWD only if it names the directory we are in.
+static void pwd_init() {
+    const char *env = var_get("PWD");
+    struct stat a, b;
+    if (env && env[0] == '/' && stat(env, &a) == 0 && stat(".", &b) == 0 &&
+        a.st_dev == b.st_dev && a.st_ino == b.st_ino) shell_pwd = strdup(env);
+    else shell_pwd = getcwd(NULL, 0);
+    if (!shell_pwd) shell_pwd = strdup("");
+    if (*shell_pwd) var_set("PWD", shell_pwd, true);
+}
+
+// rel (absolute, or relative to the absolute base) with "//", "." and
+// ".." resolved lexically, as cd -L does. Returns a malloc'd path.
+static char *path_clean(const char *base, const char *rel) {
+    size_t cap = strlen(base) + strlen(rel) + 3;
+    char *src = malloc(cap), *out = malloc(cap);
+    snprintf(src, cap, "%s/%s", rel[0] == '/' ? "" : base, rel);
+    size_t n = 0;
+    for (char *p = src; *p; ) {
+        while (*p == '/') p++;
+        char *e = p + strcspn(p, "/");
+        size_t len = (size_t)(e - p);
+        if (len == 0 || (len == 1 && p[0] == '.')) {
+        } else if (len == 2 && p[0] == '.' && p[1] == '.') {
+            while (n > 0 && out[n-1] != '/') n--;
+            if (n > 0) n--;
+        } else {
+            out[n++] = '/';
+            memcpy(out + n, p, len);
+            n += len;
+        }
+        p = e;
+    }
+    if (n == 0) out[n++] = '/';
+    out[n] = '\0';
+    free(src);
+    return out;
+}
+
+// PS1 is compiled once into literal runs and fields, and the rendered
+// prompt is kept until something it shows changes (cd, a new PS1), so
+// printing it costs one write(2) and no other syscall.
+//   \w cwd with ~ for $HOME   \W its last component   \u user   \h host
+//   \H full host              \$ # for root, else $   \n newline   \\ backslash
+#define DEFAULT_PS1 "mysh:\\w$ "
+
+static char  *ps1_source = NULL;      // the PS1 the template was built from
+static char  *ps1_template = NULL;    // literals, with fields as '\0' + code
+static size_t ps1_template_len = 0;
+static char  *prompt_buf = NULL;      // rendered prompt, valid unless dirty
+static size_t prompt_len = 0, prompt_cap = 0;
+static bool   prompt_dirty = true;
+
+static void prompt_compile(const char *ps1) {
+    free(ps1_source);
+    ps1_source = strdup(ps1);
+    free(ps1_template);
+    ps1_template = malloc(strlen(ps1) * 2 + 1);
+    size_t n = 0;
+    for (const char *p = ps1; *p; p++) {
+        if (*p == '\\' && p[1] && strchr("wWuhH$", p[1])) {
+            ps1_template[n++] = '\0';
+            ps1_template[n++] = *++p;
+        } else if (*p == '\\' && p[1] == 'n') { ps1_template[n++] = '\n'; p++; }
+        else if (*p == '\\' && p[1] == '\\') { ps1_template[n++] = '\\'; p++; }
+        else ps1_template[n++] = *p;
+    }
+    ps1_template_len = n;
+    prompt_dirty = true;
+}
+
+static void prompt_append(const char *s, size_t n) {
+    if (prompt_len + n > prompt_cap) {
+        while (prompt_len + n > prompt_cap) prompt_cap = prompt_cap ? prompt_cap*2 : 256;
+        prompt_buf = realloc(prompt_buf, prompt_cap);
+    }
+    memcpy(prompt_buf + prompt_len, s, n);
+    prompt_len += n;
+}
+
+static void prompt_render() {
+    static char user[256], host[256];
+    if (!user[0]) {
+        const struct passwd *pw = getpwuid(geteuid());
+        snprintf(user, sizeof(user), "%s", pw ? pw->pw_name : "?");
+        if (gethostname(host, sizeof(host)) < 0) strcpy(host, "?");
+        host[sizeof(host)-1] = '\0';
+    }
+    prompt_len = 0;
+    for (size_t i=0;i<ps1_template_len;i++) {
+        if (ps1_template[i]) { prompt_append(&ps1_template[i], 1); continue; }
+        const char *home = var_get("HOME");
+        size_t hl = home ? strlen(home) : 0;
+        switch (ps1_template[++i]) {
+        case 'w':
+            if (hl > 1 && strncmp(shell_pwd, home, hl) == 0 && (!shell_pwd[hl] || shell_pwd[hl] == '/')) {
+                prompt_append("~", 1);
+                prompt_append(shell_pwd + hl, strlen(shell_pwd + hl));
+            } else prompt_append(shell_pwd, strlen(shell_pwd));
+            break;
+        case 'W': {
+            const char *b = strrchr(shell_pwd, '/');
+            b = b && b[1] ? b+1 : shell_pwd;
+            prompt_append(b, strlen(b));
+            break;
+        }
+        case 'u': prompt_append(user, strlen(user)); break;
+        case 'H': prompt_append(host, strlen(host)); break;
+        case 'h': prompt_append(host, strcspn(host, ".")); break;
+        case '$': prompt_append(geteuid() == 0 ? "#" : "$", 1); break;
+        }
+    }
+    prompt_dirty = false;
+}
+
+// The current prompt text, rendered only if something in it changed.
+static const char *prompt_get(size_t *len) {
+    const char *ps1 = var_get("PS1");
+    if (!ps1) ps1 = DEFAULT_PS1;
+    if (!ps1_source || strcmp(ps1, ps1_source) != 0) prompt_compile(ps1);
+    if (prompt_dirty) prompt_render();
+    *len = prompt_len;
+    return prompt_buf;
+}
+
+// PS2 for the lines that continue an unfinished command, else PS1.
+static const char *line_prompt(bool more, size_t *len) {
+    if (!more) return prompt_get(len);
+    const char *ps2 = var_get("PS2");
+    if (!ps2) ps2 = "> ";
+    *len = strlen(ps2);
+    return ps2;
+}
+
+static void print_prompt(bool more) {
+    long long t0 = mono_ns();
+    size_t len;
+    const char *p = line_prompt(more, &len);
+    fflush(stdout);   // whatever stdio still holds goes first
+    if (write(STDOUT_FILENO, p, len) < 0) perror("write");
+    stat_record(ST_PROMPT, mono_ns() - t0);
+}
+
+// A new PATH empties the command hash; HOME shows in \w.
+static void var_changed(const char *name) {
+    if (strcmp(name, "PATH") == 0) hash_clear();
+    else if (strcmp(name, "HOME") == 0 || strcmp(name, "PS1") == 0) prompt_dirty = true;
+}
+
+// ---------- execution ----------
+// cd [dir | -]: logical, like sh's cd -L. The cleaned path is tried first;
+// if that fails (a ".." across a symlink that isn't there physically) the
+// plain argument is, and the kernel's idea of where we ended up is taken.
+static int builtin_cd(char **argv) {
+    const char *target = argv[1] ? argv[1] : var_get("HOME");
+    bool dash = target && strcmp(target, "-") == 0;
+    if (dash && !(target = var_get("OLDPWD"))) { fprintf(stderr, "cd: OLDPWD not set\n"); return -1; }
+    if (!target) target = ".";
+    char *next = path_clean(*shell_pwd ? shell_pwd : "/", target);
+    if (chdir(next) != 0) {
+        int err = errno;
+        free(next);
+        if (chdir(target) != 0) { fprintf(stderr, "cd: %s: %s\n", target, strerror(err)); return -1; }
+        if (!(next = getcwd(NULL, 0))) next = strdup("");
+    }
+    if (*shell_pwd) var_set("OLDPWD", shell_pwd, true);
+    free(shell_pwd);
+    shell_pwd = next;
+    if (*shell_pwd) var_set("PWD", shell_pwd, true);
+    prompt_dirty = true;
+    if (dash) puts(shell_pwd);
+    return 0;
+}
+
+// pwd prints the logical directory; pwd -P asks the kernel.
+static int builtin_pwd(char **argv) {
+    if (argv[1] && strcmp(argv[1], "-P") == 0) {
+        char *cwd = getcwd(NULL, 0);
+        if (!cwd) { perror("pwd"); return -1; }
+        puts(cwd);
+        free(cwd);
+        return 0;
+    }
+    if (!*shell_pwd) { fprintf(stderr, "pwd: current directory unknown\n"); return -1; }
+    puts(shell_pwd);
+    return 0;
+}
+
+// ---- control flow state ----
+static int  loop_depth = 0;       // loops being run, for break and continue
+static int  breaking = 0;         // loop levels still to leave
+static int  continuing = 0;       // likewise, the last one to go round again
+static int  func_depth = 0;
+static bool returning = false;    // unwinding to the function call
+static int  return_status = 0;
+static bool interrupted = false;  // a foreground job died of SIGINT: stop the lot
+
+static int builtin_exit(char **argv) {
+    exit(argv[1] ? atoi(argv[1]) : last_status);
+}
+
+static int builtin_return(char **argv) {
+    if (!func_depth) { fprintf(stderr, "return: can only `return' from a function\n"); return -1; }
+    return_status = argv[1] ? atoi(argv[1]) & 255 : last_status;
+    returning = true;
+    return 0;
+}
+
+// break [n] and continue [n]: the count of enclosing loops to leave, the
+// last of them going round again for continue.
+static int loop_levels(char **argv) {
+    if (!loop_depth) { fprintf(stderr, "%s: only meaningful in a loop\n", argv[0]); return -1; }
+    int n = argv[1] ? atoi(argv[1]) : 1;
+    if (n < 1) { fprintf(stderr, "%s: %s: loop count out of range\n", argv[0], argv[1]); return -1; }
+    return n > loop_depth ? loop_depth : n;
+}
+
+static int builtin_break(char **argv) {
+    int n = loop_levels(argv);
+    if (n < 0) return -1;
+    breaking = n;
+    return 0;
+}
+
+static int builtin_continue(char **argv) {
+    int n = loop_levels(argv);
+    if (n < 0) return -1;
+    continuing = n;
+    return 0;
+}
+
+static int builtin_jobs(char **argv) {
+    (void)argv;
+    reap_children();
+    remove_done_jobs();
+    print_jobs(argv[1] && strcmp(argv[1], "-v")==0);
+    return 0;
+}
+
+static int builtin_history(char **argv) {
+    if (argv[1] && strcmp(argv[1], "-s")==0) {
+        if (!argv[2]) { fprintf(stderr, "history -s <pattern>\n"); return -1; }
+        size_t n;
+        unsigned long *seqs = hist_search(argv[2], &n);
+        for (size_t i=0;i<n;i++)
+            printf("%lu  %.*s\n", seqs[i], (int)hist_at(seqs[i])->len, hist_at(seqs[i])->s);
+        free(seqs);
+        return n ? 0 : -1;
+    }
+    for (unsigned long q = hist_first; q < hist_next; q++)
+        printf("%lu  %.*s\n", q, (int)hist_at(q)->len, hist_at(q)->s);
+    return 0;
+}
+
+static int builtin_fg(char **argv) {
+    if (!argv[1]) { fprintf(stderr, "fg <job_id>\n"); return -1; }
+    Job *j = resolve_job(argv[1]);
+    if (!j) { fprintf(stderr, "fg: no such job\n"); return -1; }
+    // Give terminal to job, continue, wait, restore
+    if (job_control) tcsetpgrp(STDIN_FILENO, j->pgid);
+    for (int i=0;i<j->nprocs;i++) if (j->procs[i].state == JOB_STOPPED) j->procs[i].state = JOB_RUNNING;
+    job_update_state(j);
+    job_signal(j, SIGCONT);
+    wait_for_job(j);
+    if (job_control) tcsetpgrp(STDIN_FILENO, getpgrp());
+    int rc = job_status(j);   // read before a finished job is dropped
+    finish_foreground(j);
+    return rc;
+}
+
+static int builtin_bg(char **argv) {
+    if (!argv[1]) { fprintf(stderr, "bg <job_id>\n"); return -1; }
+    Job *j = resolve_job(argv[1]);
+    if (!j) { fprintf(stderr, "bg: no such job\n"); return -1; }
+    job_signal(j, SIGCONT);
+    return 0;   // reaping flips the state on WIFCONTINUED
+}
+
+// -9, -KILL or -SIGKILL; -1 if unknown
+static int signal_number(const char *s) {
+    static const struct { const char *name; int sig; } names[] = {
+        { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+        { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "TERM", SIGTERM },
+        { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP },
+    };
+    if (isdigit((unsigned char)*s)) {
+        char *end;
+        long n = strtol(s, &end, 10);
+        return *end || n < 1 || n >= NSIG ? -1 : (int)n;
+    }
+    if (strncmp(s, "SIG", 3) == 0) s += 3;
+    for (size_t i=0;i<sizeof(names)/sizeof(names[0]);i++)
+        if (strcmp(s, names[i].name) == 0) return names[i].sig;
+    return -1;
+}
+
+static int builtin_kill(char **argv) {
+    int sig = SIGTERM;
+    if (argv[1] && argv[1][0] == '-' && argv[1][1]) {
+        if ((sig = signal_number(argv[1]+1)) < 0) { fprintf(stderr, "kill: %s: bad signal\n", argv[1]+1); return -1; }
+        argv++;
+    }
+    if (!argv[1]) { fprintf(stderr, "kill [-SIG] <job_id>\n"); return -1; }
+    Job *j = resolve_job(argv[1]);
+    if (!j) { fprintf(stderr, "kill: no such job\n"); return -1; }
+    job_signal(j, sig);
+    // a stopped job won't act on the signal until continued
+    if (j->state == JOB_STOPPED && sig != SIGSTOP && sig != SIGTSTP) job_signal(j, SIGCONT);
+    return 0;
+}
+
+// wait [-n] [job...]
+// Wait for the given jobs, or every background job. With -n, return as
+// soon as any one of them has finished (one already done counts). Fails
+// if the job waited for last failed, or there was nothing to wait for.
+// wait [-n] [job...]: the status of the last job named, or of the one
+// -n collected, 127 if there was none; bare wait waits for them all and
+// returns 0.
+static int builtin_wait(char **argv) {
+    bool any = argv[1] && strcmp(argv[1], "-n") == 0;
+    char **args = argv + 1 + any;
+    int n = 0, rc = 0;
+    reap_children();
+    if (*args) {
+        while (args[n]) n++;
+    } else {
+        for (Job *j = jobs_head; j; j = j->next) if (j->id) n++;
+    }
+    Job **want = malloc(sizeof(Job *) * (size_t)(n ? n : 1));
+    int nwant = 0;
+    if (*args) {
+        for (int i=0;i<n;i++) {
+            Job *j = resolve_job(args[i]);
+            if (j) want[nwant++] = j;
+            else { fprintf(stderr, "wait: %s: no such job\n", args[i]); rc = 127; }
+        }
+    } else {
+        for (Job *j = jobs_head; j; j = j->next) if (j->id) want[nwant++] = j;
+    }
+
+    if (any) {
+        rc = 127;
+        for (;;) {
+            int done = -1;
+            bool active = false;
+            for (int i=0;i<nwant && done < 0;i++) {
+                if (want[i]->state == JOB_DONE) done = i;
+                else if (want[i]->state == JOB_RUNNING) active = true;
+            }
+            if (done >= 0) {
+                rc = job_status(want[done]);
+                job_report(want[done]);
+                job_remove(want[done]);
+                break;
+            }
+            if (!active || wait_any_child() < 0) break;
+        }
+    } else {
+        for (int i=0;i<nwant;i++) {
+            Job *j = want[i];
+            while (j->state == JOB_RUNNING) if (wait_any_child() < 0) break;
+            if (*args) rc = job_status(j);
+            if (j->state != JOB_DONE) continue;   // stopped: still listed
+            job_report(j);
+            job_remove(j);
+        }
+    }
+    free(want);
+    return rc;
+}
+
+// ---------- zero-copy filters ----------
+// tee and cat run as forked pipeline stages that never exec. Between pipes
+// they move data with splice(2) and tee(2), so the bytes stay in the
+// kernel; any other pairing falls back to a read/write copy. Outside a
+// pipeline they're the real programs (stage_builtin).
+#define COPY_CHUNK 65536
+
+static int write_all(int fd, const char *p, size_t n) {
+    while (n) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) return -1;
+        p += w; n -= (size_t)w;
+    }
+    return 0;
+}
+
+// tee's output i failed to take a write: report it, close it and carry on
+// with the rest, as tee does for a full disk or a closed reader.
+static void drop_output(int *outs, const char **names, int *nout, int i) {
+    fprintf(stderr, "tee: %s: %s\n", names[i], strerror(errno));
+    close(outs[i]);
+    (*nout)--;
+    memmove(outs + i, outs + i + 1, sizeof(*outs) * (size_t)(*nout - i));
+    memmove(names + i, names + i + 1, sizeof(*names) * (size_t)(*nout - i));
+}
+
+// Copy in to each of outs until EOF. With names, a failing output after
+// the first is dropped; otherwise any write error ends the copy.
+static int copy_fds(int in, int *outs, const char **names, int *nout) {
+    static char buf[COPY_CHUNK];
+    for (;;) {
+        ssize_t n = read(in, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return (int)n;
+        for (int i=0;i<*nout;i++) {
+            if (write_all(outs[i], buf, (size_t)n) == 0) continue;
+            if (!names || i == 0) return -1;
+            drop_output(outs, names, nout, i--);
+        }
+    }
+}
+
+static bool is_pipe(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+#ifdef __linux__
+// Splice in to out until EOF. Returns 1, having moved nothing, when the
+// kernel can't splice this pair (neither end a pipe, an O_APPEND file).
+static int splice_all(int in, int out) {
+    bool moved = false;
+    for (;;) {
+        ssize_t n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EINVAL && !moved) return 1;
+        if (n <= 0) return (int)n;
+        moved = true;
+    }
+}
+
+// Pipe to pipe plus one file (outs[0], outs[1]): tee(2) duplicates what's
+// buffered on in into out, then the same bytes are spliced off in into the
+// file. A file the kernel won't splice into takes a read/write of those
+// bytes instead; one that fails is dropped and the rest goes to out alone.
+static int tee_splice(int in, int *outs, const char **names, int *nout) {
+    static char buf[COPY_CHUNK];
+    bool file_splice = true;
+    for (;;) {
+        ssize_t n = tee(in, outs[0], COPY_CHUNK, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return (int)n;
+        while (n > 0) {
+            ssize_t m;
+            bool failed = false;
+            if (file_splice) {
+                m = splice(in, NULL, outs[1], NULL, (size_t)n, SPLICE_F_MOVE);
+                if (m < 0 && errno == EINVAL) { file_splice = false; continue; }
+                failed = m < 0 && errno != EINTR;
+            } else {
+                m = read(in, buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf));
+                failed = m > 0 && write_all(outs[1], buf, (size_t)m) < 0;
+                if (failed) n -= m;
+            }
+            if (failed) {
+                drop_output(outs, names, nout, 1);
+                // out already has the rest of these bytes; take them off in
+                while (n > 0) {
+                    m = read(in, buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf));
+                    if (m < 0 && errno == EINTR) continue;
+                    if (m <= 0) return -1;
+                    n -= m;
+                }
+                return splice_all(in, outs[0]);
+            }
+            if (m < 0 && errno == EINTR) continue;
+            if (m <= 0) return -1;
+            n -= m;
+        }
+    }
+}
+#endif
+
+// An option we don't implement: the stage is already its own process
+// (BI_FORK), so hand it to the real binary.
+static void exec_external(char **argv) {
+    execvp(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+}
+
+static int builtin_tee(char **argv) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC, i = 1;
+    if (argv[1] && strcmp(argv[1], "-a") == 0) { flags ^= O_TRUNC | O_APPEND; i++; }
+    if (argv[i] && argv[i][0] == '-' && argv[i][1]) exec_external(argv);
+    int n = 0;
+    while (argv[i+n]) n++;
+    int *outs = malloc(sizeof(int) * (size_t)(n+1));
+    const char **names = malloc(sizeof(char *) * (size_t)(n+1));
+    int nout = 0, rc = 0;
+    names[nout] = "standard output";
+    outs[nout++] = STDOUT_FILENO;
+    for (; argv[i]; i++) {
+        int fd = open(argv[i], flags, 0644);
+        if (fd < 0) { fprintf(stderr, "tee: %s: %s\n", argv[i], strerror(errno)); rc = -1; }
+        else { names[nout] = argv[i]; outs[nout++] = fd; }
+    }
+    int opened = nout, r = 1;
+#ifdef __linux__
+    // more than one file would need a scratch pipe per file; just copy
+    if (nout <= 2 && is_pipe(STDIN_FILENO) && is_pipe(STDOUT_FILENO))
+        r = nout == 1 ? splice_all(STDIN_FILENO, STDOUT_FILENO) : tee_splice(STDIN_FILENO, outs, names, &nout);
+#endif
+    if (r == 1) r = copy_fds(STDIN_FILENO, outs, names, &nout);
+    if (r < 0) { perror("tee"); rc = -1; }
+    if (nout < opened) rc = -1;
+    for (int k=1;k<nout;k++) close(outs[k]);
+    free(outs);
+    free(names);
+    return rc;
+}
+
+static int builtin_cat(char **argv) {
+    static char *stdin_only[] = { "-", NULL };
+    char **files = argv[1] ? argv+1 : stdin_only;
+    for (int i=0;files[i];i++) if (files[i][0] == '-' && files[i][1]) exec_external(argv);
+    int rc = 0, out = STDOUT_FILENO;
+    for (int i=0;files[i];i++) {
+        bool std = strcmp(files[i], "-") == 0;
+        int fd = std ? STDIN_FILENO : open(files[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) { fprintf(stderr, "cat: %s: %s\n", files[i], strerror(errno)); rc = -1; continue; }
+        int r = 1;
+#ifdef __linux__
+        if (is_pipe(fd) || is_pipe(out)) r = splice_all(fd, out);
+#endif
+        if (r == 1) { int one = 1; r = copy_fds(fd, &out, NULL, &one); }
+        if (r < 0) { fprintf(stderr, "cat: %s: %s\n", files[i], strerror(errno)); rc = -1; }
+        if (!std) close(fd);
+    }
+    return rc;
+}
+
+// ---------- placement ----------
+// Where a stage may run: a cpu set for sched_setaffinity and a NUMA node
+// to prefer for its memory (-1 for none). Set in the forked child before
+// exec; posix_spawn has no hook for either, so placed stages always fork.
+typedef struct {
+    cpu_set_t cpus;
+    int       node;
+} Affinity;
+
+typedef enum { AFF_NONE=0, AFF_COMPACT=1 } affinity_policy;
+static affinity_policy pipeline_affinity = AFF_NONE;
+
+typedef struct { int id; cpu_set_t cpus; } NumaNode;
+static NumaNode *numa_nodes = NULL;
+static int       numa_nnodes = -1;   // -1 until sysfs has been read
+static unsigned  compact_next = 0;   // node for the next compact pipeline
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+// "0-3,8,10-11" as used by taskset and sysfs. Returns -1 on anything else.
+static int parse_cpulist(const char *s, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*s && *s != '\n') {
+        char *end;
+        if (!isdigit((unsigned char)*s)) return -1;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (*end == '-') {
+            if (!isdigit((unsigned char)end[1])) return -1;
+            hi = strtol(end+1, &end, 10);
+        }
+        if (hi < lo || hi >= CPU_SETSIZE) return -1;
+        for (long c = lo; c <= hi; c++) CPU_SET(c, set);
+        if (*end == ',') end++;
+        else if (*end && *end != '\n') return -1;
+        s = end;
+    }
+    return 0;
+}
+
+static int read_cpulist_file(const char *path, cpu_set_t *set) {
+    char buf[4096];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, sizeof(buf)-1);
+    close(fd);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    return parse_cpulist(buf, set);
+}
+
+// The node table, read from sysfs once; the topology doesn't change under us.
+static void numa_load() {
+    if (numa_nnodes >= 0) return;
+    numa_nnodes = 0;
+    cpu_set_t online;
+    if (read_cpulist_file("/sys/devices/system/node/online", &online) < 0) return;
+    numa_nodes = malloc(sizeof(NumaNode) * (size_t)CPU_COUNT(&online));
+    for (int id=0;id<CPU_SETSIZE;id++) {
+        if (!CPU_ISSET(id, &online)) continue;
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        NumaNode *nd = &numa_nodes[numa_nnodes];
+        if (read_cpulist_file(path, &nd->cpus) < 0 || !CPU_COUNT(&nd->cpus)) continue;   // memory-only node
+        nd->id = id;
+        numa_nnodes++;
+    }
+}
+
+static const NumaNode *numa_node(int id) {
+    numa_load();
+    for (int i=0;i<numa_nnodes;i++) if (numa_nodes[i].id == id) return &numa_nodes[i];
+    return NULL;
+}
+
+// A `pin` prefix: a cpu list, or node:N for that node's cpus and memory.
+static int parse_affinity(const char *spec, Affinity *af) {
+    af->node = -1;
+    if (strncmp(spec, "node:", 5) == 0) {
+        char *end;
+        long id = strtol(spec+5, &end, 10);
+        const NumaNode *nd = end != spec+5 && !*end ? numa_node((int)id) : NULL;
+        if (!nd) { fprintf(stderr, "mysh: pin: no such NUMA node `%s'\n", spec+5); return -1; }
+        af->cpus = nd->cpus;
+        af->node = nd->id;
+        return 0;
+    }
+    if (parse_cpulist(spec, &af->cpus) < 0 || !CPU_COUNT(&af->cpus)) {
+        fprintf(stderr, "mysh: pin: bad cpu list `%s'\n", spec);
+        return -1;
+    }
+    return 0;
+}
+
+// pipeline-affinity=compact: the whole pipeline on one node, so its pipe
+// buffers stay in that node's cache and memory. Pipelines take the nodes
+// in turn. With a single node there is nothing to choose, and stages keep
+// the spawn path.
+static Affinity *compact_affinity(Arena *a) {
+    numa_load();
+    if (numa_nnodes < 2) return NULL;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return NULL;
+    Affinity *af = arena_alloc(a, sizeof(Affinity));
+    for (int tries=0;tries<numa_nnodes;tries++) {
+        const NumaNode *nd = &numa_nodes[compact_next++ % (unsigned)numa_nnodes];
+        CPU_AND(&af->cpus, &nd->cpus, &allowed);
+        if (CPU_COUNT(&af->cpus)) { af->node = nd->id; return af; }
+    }
+    return NULL;
+}
+
+// In the child, before exec. Failures are reported and the stage runs
+// unplaced rather than not at all.
+static void apply_affinity(const Affinity *af) {
+    if (sched_setaffinity(0, sizeof(af->cpus), &af->cpus) < 0) perror("mysh: sched_setaffinity");
+#ifdef SYS_set_mempolicy
+    if (af->node >= 0) {
+        unsigned long mask[CPU_SETSIZE / (8 * sizeof(unsigned long))] = { 0 };
+        mask[af->node / (8 * sizeof(unsigned long))] |= 1UL << (af->node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, (unsigned long)CPU_SETSIZE) < 0)
+            perror("mysh: set_mempolicy");
+    }
+#endif
+}
+
+// ---------- shell options ----------
+// `set -o name=value`. Each option parses its own value and prints its
+// current one; adding an option is one table entry.
+//
+// launcher: stages are started either with fork()+exec or with
+// posix_spawn(), which glibc implements with clone(CLONE_VM|CLONE_VFORK)
+// and so never copies the parent's page tables. Default with
+// -DDEFAULT_LAUNCHER=LAUNCH_FORK, or MYSH_LAUNCHER=fork|spawn at startup.
+typedef enum { LAUNCH_FORK=0, LAUNCH_SPAWN=1 } launcher_kind;
+
+#ifndef DEFAULT_LAUNCHER
+#define DEFAULT_LAUNCHER LAUNCH_SPAWN
+#endif
+static launcher_kind launcher = DEFAULT_LAUNCHER;
+
+// pipesize: F_SETPIPE_SZ for every pipe the shell makes, 0 for the kernel's
+// default. A bigger buffer means fewer wakeups between fast stages.
+static int pipe_size = 0;
+
+// pipe2, close-on-exec, at pipe_size when one is set.
+static int shell_pipe(int fds[2]) {
+    if (pipe2(fds, O_CLOEXEC) < 0) return -1;
+#ifdef F_SETPIPE_SZ
+    // best effort: past pipe-user-pages-soft the kernel says no
+    if (pipe_size) fcntl(fds[1], F_SETPIPE_SZ, pipe_size);
+#endif
+    return 0;
+}
+
+static int opt_launcher(const char *v) {
+    if (strcmp(v, "fork") == 0) launcher = LAUNCH_FORK;
+    else if (strcmp(v, "spawn") == 0) launcher = LAUNCH_SPAWN;
+    else { fprintf(stderr, "mysh: launcher: expected fork or spawn\n"); return -1; }
+    return 0;
+}
+
+static void show_launcher() { puts(launcher == LAUNCH_SPAWN ? "spawn" : "fork"); }
+
+static long pipe_max_size() {
+    long max = -1;
+    FILE *f = fopen("/proc/sys/fs/pipe-max-size", "re");
+    if (f) { if (fscanf(f, "%ld", &max) != 1) max = -1; fclose(f); }
+    return max;
+}
+
+static int opt_pipesize(const char *v) {
+    char *end;
+    errno = 0;
+    unsigned long n = strtoul(v, &end, 10);
+    int shift = 0;
+    if (*end == 'k' || *end == 'K') { shift = 10; end++; }
+    else if (*end == 'm' || *end == 'M') { shift = 20; end++; }
+    if (strcmp(v, "default") == 0) n = 0, end = "";
+    else if (end == v || *end || errno || n > (unsigned long)INT_MAX >> shift) {
+        fprintf(stderr, "mysh: pipesize: bad size `%s'\n", v);
+        return -1;
+    }
+    n <<= shift;
+    if (n == 0) { pipe_size = 0; return 0; }
+#ifdef F_SETPIPE_SZ
+    // try it on a scratch pipe: the kernel rounds up to a power of two
+    // pages, and refuses more than pipe-max-size unless we're privileged
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) { perror("pipe"); return -1; }
+    int got = fcntl(fds[1], F_SETPIPE_SZ, (int)n);
+    if (got < 0 && errno == EPERM) {
+        long max = pipe_max_size();
+        if (max > 0) got = fcntl(fds[1], F_SETPIPE_SZ, (int)max);
+    }
+    int err = errno;
+    close(fds[0]); close(fds[1]);
+    if (got < 0) { fprintf(stderr, "mysh: pipesize: %s\n", strerror(err)); return -1; }
+    if ((unsigned long)got != n) fprintf(stderr, "mysh: pipesize: using %d bytes\n", got);
+    pipe_size = got;
+    return 0;
+#else
+    fprintf(stderr, "mysh: pipesize: not supported here\n");
+    return -1;
+#endif
+}
+
+static void show_pipesize() {
+    if (pipe_size) printf("%d\n", pipe_size);
+    else puts("default");
+}
+
+static int opt_pipeline_affinity(const char *v) {
+    if (strcmp(v, "none") == 0) pipeline_affinity = AFF_NONE;
+    else if (strcmp(v, "compact") == 0) pipeline_affinity = AFF_COMPACT;
+    else { fprintf(stderr, "mysh: pipeline-affinity: expected none or compact\n"); return -1; }
+    return 0;
+}
+
+static void show_pipeline_affinity() { puts(pipeline_affinity == AFF_COMPACT ? "compact" : "none"); }
+
+// cgroup-root: must be a cgroup v2 directory we can make leaves in. The
+// controllers the limits need are enabled for its children on the way.
+static int opt_cgroup_root(const char *v) {
+    if (strcmp(v, "none") == 0 || !*v) { free(cgroup_root); cgroup_root = NULL; return 0; }
+    char buf[256];
+    if (cgroup_read(v, "cgroup.controllers", buf, sizeof(buf)) < 0) {
+        fprintf(stderr, "mysh: cgroup-root: %s is not a cgroup v2 directory\n", v);
+        return -1;
+    }
+    if (access(v, W_OK) < 0) { fprintf(stderr, "mysh: cgroup-root: %s: %s\n", v, strerror(errno)); return -1; }
+    static const char *ctl[] = { "cpu", "memory", "io" };
+    for (int i=0;i<3;i++) {
+        char want[16];
+        snprintf(want, sizeof(want), "+%s", ctl[i]);
+        // a controller the kernel doesn't offer here is only missed if used
+        for (char *p = buf; (p = strstr(p, ctl[i])); p++) {
+            if ((p == buf || p[-1] == ' ') && (!p[strlen(ctl[i])] || isspace((unsigned char)p[strlen(ctl[i])]))) {
+                cgroup_write(v, "cgroup.subtree_control", want);
+                break;
+            }
+        }
+    }
+    free(cgroup_root);
+    cgroup_root = strdup(v);
+    return 0;
+}
+
+static void show_cgroup_root() { puts(cgroup_root ? cgroup_root : "none"); }
+
+// cpu.max etc. are passed to the kernel as written: "50000 100000", "1G",
+// "8:0 rbps=1048576". "none" leaves the file alone.
+static int set_limit(char **limit, const char *v) {
+    free(*limit);
+    *limit = strcmp(v, "none") == 0 || !*v ? NULL : strdup(v);
+    return 0;
+}
+
+static int opt_cgroup_cpu_max(const char *v)    { return set_limit(&cgroup_cpu_max, v); }
+static int opt_cgroup_memory_max(const char *v) { return set_limit(&cgroup_memory_max, v); }
+static int opt_cgroup_io_max(const char *v)     { return set_limit(&cgroup_io_max, v); }
+static void show_cgroup_cpu_max()    { puts(cgroup_cpu_max ? cgroup_cpu_max : "none"); }
+static void show_cgroup_memory_max() { puts(cgroup_memory_max ? cgroup_memory_max : "none"); }
+static void show_cgroup_io_max()     { puts(cgroup_io_max ? cgroup_io_max : "none"); }
+
+typedef struct {
+    const char *name;
+    int  (*set)(const char *value);   // -1 after reporting a bad value
+    void (*show)();
+} ShellOption;
+
+static const ShellOption shell_options[] = {
+    { "launcher", opt_launcher, show_launcher },
+    { "pipesize", opt_pipesize, show_pipesize },
+    { "pipeline-affinity", opt_pipeline_affinity, show_pipeline_affinity },
+    { "cgroup-root", opt_cgroup_root, show_cgroup_root },
+    { "cgroup-cpu-max", opt_cgroup_cpu_max, show_cgroup_cpu_max },
+    { "cgroup-memory-max", opt_cgroup_memory_max, show_cgroup_memory_max },
+    { "cgroup-io-max", opt_cgroup_io_max, show_cgroup_io_max },
+};
+#define NOPTIONS (sizeof(shell_options)/sizeof(shell_options[0]))
+
+// set -o                list every option
+// set -o name           print one
+// set -o name=value     change it
+static int builtin_set(char **argv) {
+    if (!argv[1] || strcmp(argv[1], "-o") != 0 || (argv[2] && argv[3])) {
+        fprintf(stderr, "set -o [name[=value]]\n");
+        return -1;
+    }
+    const char *arg = argv[2];
+    size_t len = arg ? strcspn(arg, "=") : 0;
+    for (size_t i=0;i<NOPTIONS;i++) {
+        const ShellOption *o = &shell_options[i];
+        if (!arg) { printf("%-20s", o->name); o->show(); continue; }
+        if (strlen(o->name) != len || strncmp(o->name, arg, len) != 0) continue;
+        if (arg[len] == '=') return o->set(arg + len + 1);
+        o->show();
+        return 0;
+    }
+    if (!arg) return 0;
+    fprintf(stderr, "mysh: set: %.*s: no such option\n", (int)len, arg);
+    return -1;
+}
+
+// defined with the launcher below
+static int builtin_parallel(char **argv);
+static int builtin_coproc(char **argv);
+static int builtin_coreq(char **argv);
+static int builtin_on(char **argv);
+
+// ---------- builtin registry ----------
+// Every builtin is registered here, once: name, handler, flags.
+//   BI_PIPELINE  safe to run as a pipeline stage in a forked child
+//   BI_STATE     changes shell state, so it must run in the shell itself;
+//                without BI_PIPELINE it is refused anywhere it would fork
+//   BI_FORK      always gets its own process, even alone or last in a
+//                pipeline: a filter mustn't tie up the shell
+#define BI_PIPELINE 0x1
+#define BI_STATE    0x2
+#define BI_FORK     0x4
+
+#define BUILTINS(X) \
+    X(cd,      builtin_cd,      BI_STATE)                \
+    X(pwd,     builtin_pwd,     BI_PIPELINE)             \
+    X(exit,    builtin_exit,    BI_STATE)                \
+    X(jobs,    builtin_jobs,    BI_PIPELINE)             \
+    X(fg,      builtin_fg,      BI_STATE)                \
+    X(bg,      builtin_bg,      BI_STATE)                \
+    X(kill,    builtin_kill,    BI_STATE)                \
+    X(hash,    builtin_hash,    BI_PIPELINE | BI_STATE)  \
+    X(history, builtin_history, BI_PIPELINE)             \
+    X(set,     builtin_set,     BI_PIPELINE | BI_STATE)  \
+    X(export,  builtin_export,  BI_PIPELINE | BI_STATE)  \
+    X(unset,   builtin_unset,   BI_STATE)                \
+    X(wait,    builtin_wait,    BI_STATE)                \
+    X(return,  builtin_return,  BI_STATE)                \
+    X(break,   builtin_break,   BI_STATE)                \
+    X(continue, builtin_continue, BI_STATE)              \
+    X(parallel, builtin_parallel, BI_PIPELINE | BI_STATE) \
+    X(tee,     builtin_tee,     BI_PIPELINE | BI_FORK)   \
+    X(cat,     builtin_cat,     BI_PIPELINE | BI_FORK)   \
+    X(shellstat, builtin_shellstat, BI_PIPELINE | BI_STATE) \
+    X(coproc,  builtin_coproc,  BI_STATE)                \
+    X(coreq,   builtin_coreq,   BI_PIPELINE | BI_STATE)  \
+    X(on,      builtin_on,      BI_PIPELINE | BI_STATE)
+
+typedef struct {
+    const char *name;
+    int (*fn)(char **argv);   // the exit status; -1, after reporting, for 1
+    int flags;
+} Builtin;
+
+#define BUILTIN_ENTRY(name, fn, flags) { #name, fn, flags },
+static const Builtin builtins[] = { BUILTINS(BUILTIN_ENTRY) };
+#define NBUILTINS (sizeof(builtins)/sizeof(builtins[0]))
+
+// Perfect hash over the registry: a seed and table size under which no two
+// names collide, so a lookup is one hash, one slot and one strcmp. C can't
+// hash string literals at compile time, so the seed search runs once at
+// startup over the fixed registry.
+static const Builtin *builtin_slots[256];
+static unsigned long  builtin_seed;
+static unsigned       builtin_mask;
+
+static unsigned long builtin_hash_name(const char *s, unsigned long seed) {
+    unsigned long h = 1469598103934665603UL ^ seed;
+    while (*s) { h ^= (unsigned char)*s++; h *= 1099511628211UL; }
+    return h ^ (h >> 29);
+}
+
+static void builtins_init() {
+    for (unsigned size = 16; size <= 256; size *= 2) {
+        for (unsigned long seed = 0; seed < 4096; seed++) {
+            memset(builtin_slots, 0, sizeof(builtin_slots));
+            size_t i;
+            for (i=0;i<NBUILTINS;i++) {
+                unsigned slot = builtin_hash_name(builtins[i].name, seed) & (size-1);
+                if (builtin_slots[slot]) break;
+                builtin_slots[slot] = &builtins[i];
+            }
+            if (i == NBUILTINS) { builtin_seed = seed; builtin_mask = size-1; return; }
+        }
+    }
+    fprintf(stderr, "mysh: no perfect hash for builtin table\n");
+    exit(1);
+}
+
+static int builtin_run(const Builtin *b, char **argv) {
+    int rc = b->fn(argv);
+    return rc < 0 ? 1 : rc;
+}
+
+static const Builtin *find_builtin(const char *name) {
+    if (!name) return NULL;
+    const Builtin *b = builtin_slots[builtin_hash_name(name, builtin_seed) & builtin_mask];
+    return b && strcmp(b->name, name) == 0 ? b : NULL;
+}
+
+// Whether a splice filter (cat, tee) takes these arguments: just file
+// names, and tee's -a.
+static bool filter_args_ok(char **argv) {
+    int i = 1;
+    if (strcmp(argv[0], "tee") == 0 && argv[1] && strcmp(argv[1], "-a") == 0) i++;
+    for (; argv[i]; i++) if (argv[i][0] == '-' && argv[i][1]) return false;
+    return true;
+}
+
+// The builtin a stage runs, NULL to launch argv[0] as a program. The
+// splice filters only pay off as a stage of a pipeline (piped); alone,
+// or with an option they don't take, cat and tee are spawned like any
+// other program rather than forking the shell.
+static const Builtin *stage_builtin(char **argv, bool piped) {
+    const Builtin *b = find_builtin(argv[0]);
+    if (b && (b->flags & BI_FORK) && (!piped || !filter_args_ok(argv))) return NULL;
+    return b;
+}
+
+// 0 if b (or no builtin) may run in a forked child; -1, after reporting,
+// for one that would only change a copy of the shell about to exit.
+static int builtin_forkable(const Builtin *b) {
+    if (!b || (b->flags & (BI_STATE | BI_PIPELINE)) != BI_STATE) return 0;
+    fprintf(stderr, "mysh: %s: changes the shell, so it can't run in a pipeline\n", b->name);
+    return -1;
+}
+
+// ---- redirections ----
+// A close-on-exec descriptor reading s, plus a newline if nl. A body the
+// pipe can hold goes through it with no one reading yet; past the pipe's
+// size (one page, once pipe-user-pages-soft is used up) it goes through
+// a memfd, or else a child feeds the pipe.
+static int heredoc_fd(const char *s, bool nl) {
+    size_t n = strlen(s);
+    int fds[2];
+    if (shell_pipe(fds) < 0) return -1;
+    size_t room = PIPE_BUF;   // all a pipe is sure to hold
+#ifdef F_GETPIPE_SZ
+    int sz = fcntl(fds[1], F_GETPIPE_SZ);
+    if (sz > 0) room = (size_t)sz;
+#endif
+    if (n + nl <= room) {
+        (void)!(write_all(fds[1], s, n) == 0 && nl && write_all(fds[1], "\n", 1));
+        close(fds[1]);
+        return fds[0];
+    }
+#ifdef MFD_CLOEXEC
+    int fd = memfd_create("mysh-heredoc", MFD_CLOEXEC);
+    if (fd >= 0) {
+        close(fds[0]); close(fds[1]);
+        if (write_all(fd, s, n) == 0 && (!nl || write_all(fd, "\n", 1) == 0) && lseek(fd, 0, SEEK_SET) == 0) return fd;
+        close(fd);
+        return -1;
+    }
+#endif
+    // a child feeds the pipe; the next reap collects it
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        (void)!(write_all(fds[1], s, n) == 0 && nl && write_all(fds[1], "\n", 1));
+        _exit(0);
+    }
+    close(fds[1]);
+    if (pid < 0) { close(fds[0]); return -1; }
+    return fds[0];
+}
+
+// Whether fd is open and the user's: everything the shell holds for
+// itself, pipes in flight included, is close-on-exec.
+static bool user_fd(int fd) {
+    int fl = fcntl(fd, F_GETFD);
+    return fl >= 0 && !(fl & FD_CLOEXEC);
+}
+
+// The source descriptor of <&N or >&N; -1 for -, -2 if it's no good.
+static int dup_source(const char *w) {
+    if (strcmp(w, "-") == 0) return -1;
+    if (!isdigit((unsigned char)w[0]) || w[1] || !user_fd(w[0] - '0')) return -2;
+    return w[0] - '0';
+}
+
+// What a redirection's word opens, close-on-exec; for R_DUP the fd given.
+// -1 after reporting why not.
+static int redir_open(const Redir *r) {
+    int fd = -1;
+    switch (r->kind) {
+    case R_IN:      fd = open(r->word, O_RDONLY | O_CLOEXEC); break;
+    case R_OUT:     fd = open(r->word, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644); break;
+    case R_APPEND:  fd = open(r->word, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644); break;
+    case R_RDWR:    fd = open(r->word, O_RDWR | O_CREAT | O_CLOEXEC, 0644); break;
+    case R_HEREDOC: case R_HERESTR:
+        fd = heredoc_fd(r->word, r->kind == R_HERESTR);
+        if (fd < 0) fprintf(stderr, "mysh: here-document: %s\n", strerror(errno));
+        return fd;
+    case R_DUP:
+        fd = dup_source(r->word);
+        if (fd == -2) fprintf(stderr, "mysh: %s: bad file descriptor\n", r->word);
+        return fd;
+    }
+    if (fd < 0) fprintf(stderr, "mysh: %s: %s\n", r->word, strerror(errno));
+    return fd;
+}
+
+// Apply cmd's redirections in order, each with dup3 onto its target. With
+// saved (REDIR_FDS entries, -2 for untouched) a copy of each target is
+// kept first, -1 if it wasn't open, for restore_fds. Returns -1, after
+// reporting, if one fails.
+static int apply_redirections(const Command *cmd, int *saved) {
+    for (const Redir *r = cmd->redirs; r; r = r->next) {
+        int fd = redir_open(r);
+        if (fd < 0 && !(r->kind == R_DUP && fd == -1)) return -1;
+        if (saved && saved[r->fd] == -2) saved[r->fd] = fcntl(r->fd, F_DUPFD_CLOEXEC, REDIR_FDS);
+        if (fd == -1) close(r->fd);                // >&-
+        else if (fd == r->fd) fcntl(fd, F_SETFD, 0);
+        else {
+            dup3(fd, r->fd, 0);
+            if (r->kind != R_DUP) close(fd);
+        }
+    }
+    return 0;
+}
+
+static void restore_fds(int *saved) {
+    for (int fd = 0; fd < REDIR_FDS; fd++) {
+        if (saved[fd] == -2) continue;
+        if (saved[fd] >= 0) { dup3(saved[fd], fd, 0); close(saved[fd]); }
+        else close(fd);
+    }
+}
+
+static void setup_redirections(const Command *cmd) {
+    if (apply_redirections(cmd, NULL) < 0) _exit(1);
+}
+
+// Run a builtin in the shell process itself, with stdin taken from in_fd
+// (-1 to keep ours) and the command's redirections applied, then put the
+// shell's own descriptors back.
+// Functions and compound commands run the same way. Returns the exit
+// status.
+static int run_builtin(Arena *a, const Builtin *b, Func *f, Command *cmd, int in_fd) {
+    int saved[REDIR_FDS];
+    for (int i=0;i<REDIR_FDS;i++) saved[i] = -2;
+    fflush(stdout);
+    if (in_fd >= 0) {
+        saved[STDIN_FILENO] = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, REDIR_FDS);
+        dup3(in_fd, STDIN_FILENO, 0);
+    }
+
+    int rc = 1;
+    if (apply_redirections(cmd, saved) == 0) {
+        if (f) rc = call_function(a, f, cmd->argv);
+        else if (cmd->body) rc = exec_node(a, cmd->body);
+        else rc = b ? builtin_run(b, cmd->argv) : 0;   // bare redirections, nothing to run
+    }
+
+    fflush(stdout);
+    restore_fds(saved);
+    return rc;
+}
+
+// Report a command that couldn't be run and return its status: 127 when
+// there is no such program, 126 when it can't be executed.
+static int exec_failed(const char *name, int err) {
+    if (err == ENOENT && !strchr(name, '/')) fprintf(stderr, "mysh: %s: command not found\n", name);
+    else fprintf(stderr, "mysh: %s: %s\n", name, strerror(err));
+    return err == ENOENT ? 127 : 126;
+}
+
+// exec a resolved command in the child; never returns
+static void exec_command(char *const argv[], const char *path) {
+    if (path) {
+        execv(path, argv);
+        // hashed binary went away; fall back to a full PATH search
+        if (errno != ENOENT) _exit(exec_failed(argv[0], errno));
+    }
+    execvp(argv[0], argv);
+    _exit(exec_failed(argv[0], errno));
+}
+
+// ---------- launching ----------
+typedef struct {
+    int   in_fd;       // pipe end for stdin, -1 to inherit
+    int   out_fd;      // pipe end for stdout, -1 to inherit
+    pid_t pgid;        // 0: stage leads a new process group, -1: stay in ours
+    bool  foreground;  // hand the terminal to the group
+    const Builtin *builtin;   // run this in the forked child instead of exec
+    const Affinity *aff;      // cpus and memory node, or NULL to inherit ours
+    int   cgroup_fd;   // the job's cgroup.procs to join first; -1 for none
+    Func *func;        // a shell function to call in the child
+    int   err_fd;      // pipe end for stderr; 0 to inherit
+    int   peer_fd;     // read end of our own out_fd's pipe, closed in the child; 0 for none
+    bool  coproc;      // a coprocess: outlives the line, so it drops the others' sockets
+} Stage;
+
+static void subshell_close_fds(bool coproc);   // defined with the completion index below
+
+// The exit status a launch that returned -1 stands for: 127 for a command
+// that isn't there, 126 for one that can't run, 1 for anything else.
+static int launch_status = 1;
+
+static pid_t fork_stage(const Command *cmd, const char *path, const Stage *st) {
+    pid_t pid = fork();
+    if (pid == -1) { perror("fork"); launch_status = 1; return -1; }
+    if (pid > 0) return pid;
+
+    // child: cgroup before anything can fork, then process group, signals default
+    if (st->cgroup_fd >= 0 && write(st->cgroup_fd, "0", 1) < 0) perror("mysh: cgroup.procs");
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    sigset_t none; sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    if (st->pgid >= 0) setpgid(0, st->pgid);
+    // still ignoring SIGTTOU here, so taking the terminal can't stop us
+    if (st->foreground) tcsetpgrp(STDIN_FILENO, st->pgid ? st->pgid : getpid());
+    signal(SIGTTOU, SIG_DFL);
+    if (st->aff) apply_affinity(st->aff);
+
+    // connect pipes; every pipe fd is close-on-exec, but a builtin child
+    // never execs, and holding the read end of its own output pipe would
+    // keep it from ever seeing EPIPE
+    if (st->peer_fd > 0) close(st->peer_fd);
+    if (st->in_fd >= 0) { dup2(st->in_fd, STDIN_FILENO); close(st->in_fd); }
+    if (st->out_fd >= 0) { dup2(st->out_fd, STDOUT_FILENO); close(st->out_fd); }
+    if (st->err_fd > 0) { dup2(st->err_fd, STDERR_FILENO); close(st->err_fd); }
+
+    // redirections
+    setup_redirections(cmd);
+
+    if (cmd->envp) environ = cmd->envp;
+
+    // builtins, functions and compound commands run right here in the
+    // child, no exec needed
+    if (st->builtin || st->func || cmd->body) {
+        interactive = job_control = false;   // we're a subshell now
+        subshell_close_fds(st->coproc);
+        Arena sub = { 0 };
+        int rc = st->builtin ? builtin_run(st->builtin, (char **)cmd->argv) :
+                 st->func ? call_function(&sub, st->func, cmd->argv) : exec_node(&sub, cmd->body);
+        fflush(stdout);
+        _exit(rc);
+    }
+    if (!cmd->argv[0]) _exit(0);
+    exec_command(cmd->argv, path);
+    return -1;
+}
+
+// cmd's redirections as spawn file actions, in order. Files and here-doc
+// bodies are opened here, not by the child, so a failure is reported
+// under the file's name and a spawn error is always about the command;
+// the descriptors go in *opened for the caller to close.
+static int spawn_redirections(posix_spawn_file_actions_t *fa, const Command *cmd, int **opened, int *nopened) {
+    unsigned made = 0;   // targets of the redirections so far
+    for (const Redir *r = cmd->redirs; r; made |= 1u << r->fd, r = r->next) {
+        if (r->kind == R_DUP) {
+            // the source is ours, or made by an earlier redirection
+            int from = strcmp(r->word, "-") == 0 ? -1 :
+                       isdigit((unsigned char)r->word[0]) && !r->word[1] ? r->word[0] - '0' : -2;
+            if (from >= 0 && !(made & (1u << from)) && !user_fd(from)) from = -2;
+            if (from == -2) {
+                fprintf(stderr, "mysh: %s: bad file descriptor\n", r->word);
+                return -1;
+            }
+            if (from < 0) posix_spawn_file_actions_addclose(fa, r->fd);
+            else posix_spawn_file_actions_adddup2(fa, from, r->fd);
+            continue;
+        }
+        int fd = redir_open(r);
+        if (fd < 0) return -1;
+        *opened = realloc(*opened, sizeof(int) * (size_t)(*nopened + 1));
+        (*opened)[(*nopened)++] = fd;
+        posix_spawn_file_actions_adddup2(fa, fd, r->fd);
+    }
+    return 0;
+}
+
+static pid_t spawn_stage(const Command *cmd, const char *path, const Stage *st) {
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawnattr_init(&attr);
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+    // runs after setpgid with all signals still blocked, like the fork path
+    if (st->foreground) posix_spawn_file_actions_addtcsetpgrp_np(&fa, STDIN_FILENO);
+#endif
+    if (st->in_fd >= 0) posix_spawn_file_actions_adddup2(&fa, st->in_fd, STDIN_FILENO);
+    if (st->out_fd >= 0) posix_spawn_file_actions_adddup2(&fa, st->out_fd, STDOUT_FILENO);
+    if (st->err_fd > 0) posix_spawn_file_actions_adddup2(&fa, st->err_fd, STDERR_FILENO);
+    int nopened = 0, *opened = NULL;   // redirection descriptors the child gets
+    if (spawn_redirections(&fa, cmd, &opened, &nopened) < 0) {
+        for (int i=0;i<nopened;i++) close(opened[i]);
+        free(opened);
+        posix_spawn_file_actions_destroy(&fa);
+        posix_spawnattr_destroy(&attr);
+        launch_status = 1;
+        return -1;
+    }
+
+    sigset_t def, mask;
+    sigemptyset(&def);
+    sigaddset(&def, SIGINT); sigaddset(&def, SIGTSTP); sigaddset(&def, SIGTTOU);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if (st->pgid >= 0) {
+        posix_spawnattr_setpgroup(&attr, st->pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    pid_t pid;
+    int rc = ENOENT;
+    char **envp = cmd->envp ? cmd->envp : environ;
+    if (path) rc = posix_spawn(&pid, path, &fa, &attr, cmd->argv, envp);
+    // hashed binary went away (or was never hashed); do a full PATH search.
+    // Redirections are all open already, so ENOENT can only be the binary.
+    if (path && rc == ENOENT) hash_forget(cmd->argv[0]);
+    if (rc == ENOENT) rc = posix_spawnp(&pid, cmd->argv[0], &fa, &attr, cmd->argv, envp);
+
+    for (int i=0;i<nopened;i++) close(opened[i]);
+    free(opened);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    if (rc != 0) {
+        launch_status = exec_failed(cmd->argv[0], rc);
+        return -1;
+    }
+    return pid;
+}
+
+static pid_t launch_stage(const Command *cmd, const char *path, const Stage *st) {
+    // a bare redirection has nothing to spawn and a builtin nothing to exec;
+    // both go through a plain fork, as does a stage that must be placed
+    // or join a cgroup before it runs
+    if (launcher == LAUNCH_SPAWN && cmd->argv[0] && !st->builtin && !st->func && !st->aff && st->cgroup_fd < 0) return spawn_stage(cmd, path, st);
+    return fork_stage(cmd, path, st);
+}
+
+// ---------- parallel ----------
+// One run of parallel's command with arg appended, as a job of its own in
+// the shell's process group: Ctrl-C reaches every run at once, and none
+// of them needs the terminal handed over.
+static Job *parallel_launch(char **argv, int nbase, char *arg, bool stdin_args) {
+    argv[nbase] = arg;
+    // args read from stdin leave nothing there for the runs
+    static Redir devnull = { .kind = R_IN, .fd = STDIN_FILENO, .word = "/dev/null" };
+    Command cmd = { .argv = argv, .redirs = stdin_args ? &devnull : NULL };
+    const Builtin *b = stage_builtin(argv, false);
+    const char *path = b ? NULL : hash_lookup(argv[0]);
+    int cg_fd;
+    char *cg = cgroup_create(&cg_fd);
+    Stage st = { .in_fd = -1, .out_fd = -1, .pgid = -1, .builtin = b, .cgroup_fd = cg_fd };
+    fflush(stdout);
+    pid_t pid = launch_stage(&cmd, path, &st);
+    if (cg_fd >= 0) close(cg_fd);
+    if (pid < 0) {
+        if (cg) cgroup_destroy(cg);
+        return NULL;
+    }
+
+    char *hashed = path ? strdup(argv[0]) : NULL;
+    size_t len = 0;
+    for (int k=0;k<=nbase;k++) len += strlen(argv[k]) + 1;
+    char *line = malloc(len), *w = line;
+    for (int k=0;k<=nbase;k++) w += sprintf(w, k ? " %s" : "%s", argv[k]);
+    Job *j = job_create(getpgrp(), line, &pid, &hashed, argv, 1);
+    j->cgroup = cg;
+    free(line);
+    return j;
+}
+
+// parallel [-j N] cmd [args...] [::: arg...]
+// Run cmd once per argument, taken from the list or else one per line of
+// stdin, with the argument appended and at most N runs at a time (default:
+// one per online cpu). Scheduling is just the job table: launch while
+// there is room, block in wait4 for any exit, refill. Output is not
+// grouped. Fails if any run failed; a run killed by SIGINT stops the rest.
+static int builtin_parallel(char **argv) {
+    long max = sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 1;
+    if (argv[i] && strcmp(argv[i], "-j") == 0) {
+        max = argv[i+1] ? atol(argv[i+1]) : 0;
+        if (max < 1) { fprintf(stderr, "parallel: -j needs a positive count\n"); return -1; }
+        i += 2;
+    }
+    if (max < 1) max = 1;
+    char **base = argv + i;
+    int nbase = 0;
+    while (base[nbase] && strcmp(base[nbase], ":::") != 0) nbase++;
+    if (!nbase) { fprintf(stderr, "parallel [-j N] cmd [args...] [::: arg...]\n"); return -1; }
+    if (builtin_forkable(find_builtin(base[0])) < 0) return -1;
+    char **list = base[nbase] ? base + nbase + 1 : NULL;
+
+    LineReader in = { .fd = STDIN_FILENO };
+    char **cargv = malloc(sizeof(char *) * (size_t)(nbase + 2));
+    memcpy(cargv, base, sizeof(char *) * (size_t)nbase);
+    cargv[nbase+1] = NULL;
+    Job **running = NULL;
+    int nrun = 0, cap = 0, rc = 0;
+    bool more = true;
+    for (;;) {
+        while (more && nrun < max) {
+            char *arg = list ? *list : read_line(&in);
+            if (!arg) { more = false; break; }
+            if (list) list++;
+            Job *j = parallel_launch(cargv, nbase, arg, !list);
+            if (!j) { rc = -1; continue; }
+            if (nrun == cap) {
+                cap = cap ? cap*2 : 16;
+                running = realloc(running, sizeof(Job *) * (size_t)cap);
+            }
+            running[nrun++] = j;
+        }
+        if (!nrun || wait_any_child() < 0) break;
+        for (int k=0;k<nrun;) {
+            Job *j = running[k];
+            if (j->state == JOB_RUNNING) { k++; continue; }
+            if (j->state == JOB_DONE && job_failed(j)) rc = -1;
+            int st = j->procs[0].status;
+            if (j->state == JOB_DONE && WIFSIGNALED(st) && WTERMSIG(st) == SIGINT) more = false;
+            finish_foreground(j);   // a stopped run is left to fg/bg
+            running[k] = running[--nrun];
+        }
+    }
+    free(running);
+    free(cargv);
+    free(in.buf);
+    return rc;
+}
+
+// PIPESTATUS holds every stage's status, space-separated: no arrays here,
+// but `for s in $PIPESTATUS` reads it. Without a job, nothing could be
+// launched and launch_rc has each stage's status.
+static void set_pipestatus(const Job *j, const int *launch_rc, int nproc, int last_rc, bool lastpipe) {
+    char buf[256];
+    size_t len = 0;
+    for (int i=0;i<nproc + lastpipe && len < sizeof(buf) - 16;i++) {
+        int st = i >= nproc ? last_rc : j ? proc_status(j, i) : launch_rc[i];
+        len += (size_t)snprintf(buf + len, sizeof(buf) - len, i ? " %d" : "%d", st);
+    }
+    buf[len] = '\0';
+    var_set("PIPESTATUS", buf, false);
+}
+
+// Execute a parsed pipeline, taking per-stage scratch from a (the line's
+// arena), and return its exit status. If it ends in '&', don't wait; add
+// to jobs.
+static int execute_line(Arena *a, const Pipeline *pl, const char *full_cmd_for_jobs) {
+    int nseg = pl->ncmds;
+    bool background = pl->background;
+    Command **cmds = pl->cmds;
+    if (pl->expand) {
+        subst_status = 0;
+        cmds = arena_alloc(a, sizeof(Command *) * (size_t)nseg);
+        for (int i=0;i<nseg;i++) cmds[i] = expand_command(a, pl->cmds[i]);
+    }
+
+    // A single builtin, function or compound command without pipes runs
+    // in the shell itself
+    Command *last = cmds[nseg-1];
+    Func *last_f = find_function(last->argv[0]);
+    const Builtin *last_b = last_f ? NULL : find_builtin(last->argv[0]);
+    bool in_shell = last_f || last->body || (last_b && !(last_b->flags & BI_FORK));
+    if (nseg == 1 && !last->argv[0] && !last->body && last->assign) {   // NAME=value alone sets it
+        for (char **as = last->assign; *as; as++) {
+            size_t nl = strcspn(*as, "=");
+            (*as)[nl] = '\0';
+            var_set(*as, *as + nl + 1, false);
+        }
+        if (!last->redirs) return subst_status;
+    }
+    if (nseg == 1 && (in_shell || !last->argv[0]) && !(background && (last_f || last->body))) {
+        struct rusage before, after;
+        struct timespec t0, t1;
+        if (pl->timed) { getrusage(RUSAGE_SELF, &before); clock_gettime(CLOCK_MONOTONIC, &t0); }
+        char **saved = last->argv[0] && last->assign ? assign_push(a, last->assign) : NULL;
+        int rc = run_builtin(a, last_b, last_f, last, -1);
+        if (saved) assign_pop(a, last->assign, saved);
+        if (pl->timed) {
+            getrusage(RUSAGE_SELF, &after); clock_gettime(CLOCK_MONOTONIC, &t1);
+            timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+            timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+            print_time_report(ts_diff(&t0, &t1), &after);
+        }
+        set_pipestatus(NULL, NULL, 0, rc, true);
+        return rc;
+    }
+    // lastpipe: a builtin ending a foreground pipeline runs in the shell,
+    // reading the pipe the other stages feed
+    bool lastpipe = in_shell && !background;
+    int nproc = lastpipe ? nseg-1 : nseg;
+    for (int i=0;i<nproc;i++)
+        if (!find_function(cmds[i]->argv[0]) && builtin_forkable(find_builtin(cmds[i]->argv[0])) < 0) return 1;
+
+    // placement: a stage's own `pin` wins over the pipeline-wide policy
+    const Affinity *shared = pipeline_affinity == AFF_COMPACT ? compact_affinity(a) : NULL;
+    const Affinity **aff = arena_alloc(a, sizeof(Affinity *) * (size_t)nseg);
+    for (int i=0;i<nproc;i++) {
+        aff[i] = shared;
+        if (!cmds[i]->pin) continue;
+        Affinity *af = arena_alloc(a, sizeof(Affinity));
+        if (parse_affinity(cmds[i]->pin, af) < 0) return 1;
+        aff[i] = af;
+    }
+
+
+    pid_t pgid = 0;
+    pid_t *pids = arena_alloc(a, sizeof(pid_t) * (size_t)nseg);
+    int *launch_rc = arena_alloc(a, sizeof(int) * (size_t)nseg);   // for stages that didn't start
+    char **hashed = arena_alloc(a, sizeof(char *) * (size_t)nseg);   // names resolved through the hash
+    fflush(stdout);            // builtin output must land before the children's
+    // Each pipe is made just before the stage that writes it, close-on-exec
+    // so no child has to close anything, and the parent drops its ends as
+    // soon as the stage on either side has them: at most three pipe fds are
+    // open here at any time.
+    int prev_rd = -1;          // read end that feeds stage i
+    int cg_fd = -1;
+    long long t_launch = mono_ns(), launch_ns = 0;
+    char *cg = nproc ? cgroup_create(&cg_fd) : NULL;
+    for (int i=0;i<nproc;i++) {
+        int fds[2] = { -1, -1 };
+        if (i < nseg-1 && shell_pipe(fds) == -1) {
+            perror("pipe");
+            nproc = i;         // run what we have; it sees EOF where the rest was
+            lastpipe = false;
+            break;
+        }
+        const Command *cmd = cmds[i];
+        Func *f = find_function(cmd->argv[0]);
+        const Builtin *b = f ? NULL : stage_builtin(cmd->argv, nseg > 1);
+        const char *path = b || f || cmd->body ? NULL : hash_lookup(cmd->argv[0]);
+        hashed[i] = path ? strdup(cmd->argv[0]) : NULL;
+        Stage st = {
+            .in_fd = prev_rd,
+            .out_fd = fds[1],
+            .pgid = job_control ? pgid : -1,
+            .foreground = job_control && !background && i==0,
+            .builtin = b,
+            .aff = aff[i],
+            .cgroup_fd = cg_fd,
+            .func = f,
+            .peer_fd = fds[0] >= 0 ? fds[0] : 0,
+        };
+        long long t0 = mono_ns();
+        pid_t pid = launch_stage(cmd, path, &st);
+        long long t1 = mono_ns();
+        stat_record(ST_LAUNCH, t1 - t0);
+        launch_ns += t1 - t0;
+        if (prev_rd >= 0) close(prev_rd);
+        if (fds[1] >= 0) close(fds[1]);
+        prev_rd = fds[0];
+        pids[i] = pid;
+        if (pid == -1) launch_rc[i] = launch_status;
+        if (pid == -1 || !job_control) continue;
+        if (pgid == 0) pgid = pid;
+        setpgid(pid, pgid);
+    }
+    if (!job_control) {
+        for (int i=0;i<nproc;i++) if (pids[i] > 0) pgid = getpgrp();
+    }
+
+    // all that's left open is the read end an in-shell last stage reads
+    if (!lastpipe && prev_rd >= 0) { close(prev_rd); prev_rd = -1; }
+    char **names = arena_alloc(a, sizeof(char *) * (size_t)nseg);
+    for (int i=0;i<nproc;i++) names[i] = cmds[i]->argv[0];
+    if (cg_fd >= 0) close(cg_fd);
+    Job *j = pgid ? job_create(pgid, full_cmd_for_jobs, pids, hashed, names, nproc) : NULL;
+    if (!j) for (int i=0;i<nproc;i++) free(hashed[i]);
+    if (!j && cg) cgroup_destroy(cg);
+    if (j) {
+        j->timed = pl->timed;
+        j->cgroup = cg;
+        for (int i=0;i<nproc;i++) if (pids[i] == -1) j->procs[i].status = W_EXITCODE(launch_rc[i], 0);
+    }
+
+    if (background) {
+        if (!j) return 1;
+        trace_event("background", full_cmd_for_jobs, "stages,launch_ns", (long long)nproc, launch_ns);
+        job_assign_id(j);
+        if (interactive) printf("[%%%d] started in background, PGID=%d\n", j->id, pgid);
+        return 0;
+    }
+
+    // Foreground: wait for the whole group
+    if (j && job_control) tcsetpgrp(STDIN_FILENO, pgid);
+    int rc = nproc ? launch_rc[nproc-1] : 1;   // nothing could be started
+    // a spawn that failed may still have handed the terminal to its group
+    if (!j && job_control) tcsetpgrp(STDIN_FILENO, getpgrp());
+    if (lastpipe) {
+        rc = run_builtin(a, last_b, last_f, last, prev_rd);
+        close(prev_rd);
+    }
+    if (!j) { set_pipestatus(NULL, launch_rc, nproc, rc, lastpipe); return rc; }
+    long long t_wait = mono_ns();
+    wait_for_job(j);
+    long long wait_ns = mono_ns() - t_wait;
+    // Restore control of terminal to shell
+    if (job_control) tcsetpgrp(STDIN_FILENO, getpgrp());
+    if (!lastpipe) rc = job_status(j);
+    set_pipestatus(j, NULL, j->nprocs, rc, lastpipe);
+    stat_record(ST_WAIT, wait_ns);
+    if (j->state == JOB_DONE) {
+        long long exit_ns = (long long)j->finished.tv_sec * 1000000000LL + j->finished.tv_nsec - t_launch;
+        stat_record(ST_EXIT, exit_ns);
+        trace_event("pipeline", full_cmd_for_jobs, "stages,launch_ns,exit_ns,wait_ns,status",
+                    (long long)nproc, launch_ns, exit_ns, wait_ns, (long long)rc);
+    }
+    for (int i=0;i<j->nprocs;i++) {
+        int st = j->procs[i].status;
+        if (j->procs[i].state == JOB_DONE && WIFSIGNALED(st) && WTERMSIG(st) == SIGINT) interrupted = true;
+    }
+    finish_foreground(j);
+    return rc;
+}
+
+// ---------- coprocesses ----------
+// A long-lived command the shell talks to a line at a time, so a loop
+// that calls the same tool a thousand times pays for one fork and exec.
+// The child's stdin and stdout are one end of a socketpair; the shell
+// keeps the other, close-on-exec, and the child is an ordinary job.
+// Sends use MSG_NOSIGNAL, so a coprocess that died is an error, not a
+// SIGPIPE. The command must flush each reply: awk's fflush(), jq
+// --unbuffered, sed -u, grep --line-buffered.
+typedef struct Coproc {
+    char  *name;
+    int    fd;             // -1 once closed or at EOF
+    pid_t  pid;
+    char   buf[4096];      // read ahead of the current reply
+    size_t len, pos;
+    struct Coproc *next;
+} Coproc;
+
+static Coproc *coprocs = NULL;
+
+static Coproc *find_coproc(const char *name) {
+    for (Coproc *c = coprocs; c; c = c->next)
+        if (strcmp(c->name, name) == 0) return c;
+    return NULL;
+}
+
+static void coproc_close(Coproc *c) {
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    c->len = c->pos = 0;
+}
+
+static volatile sig_atomic_t coreq_interrupted = 0;
+static void coreq_sigint(int sig) { (void)sig; coreq_interrupted = 1; }
+
+// The next line from c, without its newline, in a; NULL at EOF or on
+// Ctrl-C. An interactive shell ignores SIGINT, so for the wait it
+// handles it, without SA_RESTART, to get out of the read.
+static char *coproc_read_line(Arena *a, Coproc *c) {
+    struct sigaction sa = { .sa_handler = coreq_sigint }, old;
+    sigemptyset(&sa.sa_mask);
+    bool catch = interactive;
+    if (catch) { coreq_interrupted = 0; sigaction(SIGINT, &sa, &old); }
+    char *line = NULL;
+    size_t n = 0;
+    for (;;) {
+        char *nl = memchr(c->buf + c->pos, '\n', c->len - c->pos);
+        size_t take = nl ? (size_t)(nl - (c->buf + c->pos)) : c->len - c->pos;
+        line = arena_realloc(a, line, n, n + take + 1);
+        memcpy(line + n, c->buf + c->pos, take);
+        n += take;
+        line[n] = '\0';
+        c->pos += take;
+        if (nl) { c->pos++; break; }
+        c->pos = c->len = 0;
+        ssize_t r = read(c->fd, c->buf, sizeof(c->buf));
+        if (r < 0 && errno == EINTR && !coreq_interrupted) continue;
+        if (r <= 0) {
+            // ECONNRESET: it exited leaving our request unread
+            if (r == 0 || errno == ECONNRESET) {
+                coproc_close(c);
+                if (n) break;   // a last reply without its newline
+            }
+            line = NULL;
+            break;
+        }
+        c->len = (size_t)r;
+    }
+    int err = errno;
+    if (catch) sigaction(SIGINT, &old, NULL);
+    errno = err;
+    return line;
+}
+
+// coproc [-n NAME] cmd [args...]   start cmd as coprocess NAME (default COPROC)
+// coproc -c NAME                   close it: the command reads EOF and can exit
+// coproc                           list them
+// NAME_PID is set to the child's pid.
+static int builtin_coproc(char **argv) {
+    if (!argv[1]) {
+        for (Coproc *c = coprocs; c; c = c->next)
+            printf("%-12s %d  %s\n", c->name, (int)c->pid, c->fd >= 0 ? "open" : "closed");
+        return 0;
+    }
+    const char *name = "COPROC";
+    int i = 1;
+    if (strcmp(argv[1], "-c") == 0) {
+        Coproc *c = argv[2] ? find_coproc(argv[2]) : NULL;
+        if (!c) { fprintf(stderr, "coproc: %s: no such coprocess\n", argv[2] ? argv[2] : ""); return -1; }
+        coproc_close(c);
+        return 0;
+    }
+    if (strcmp(argv[1], "-n") == 0 && argv[2]) { name = argv[2]; i = 3; }
+    if (!argv[i] || name_len(name) != strlen(name)) {
+        fprintf(stderr, "coproc [-n NAME] cmd [args...] | coproc -c NAME\n");
+        return -1;
+    }
+    Coproc *c = find_coproc(name);
+    if (c && c->fd >= 0) { fprintf(stderr, "coproc: %s: already running\n", name); return -1; }
+    if (!find_function(argv[i]) && builtin_forkable(find_builtin(argv[i])) < 0) return -1;
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) { perror("socketpair"); return -1; }
+    int child_out = fcntl(sv[1], F_DUPFD_CLOEXEC, REDIR_FDS);   // the stage closes each end it gets
+    Command cmd = { .argv = argv + i };
+    Func *f = find_function(argv[i]);
+    const Builtin *b = f ? NULL : stage_builtin(argv + i, false);
+    const char *path = b || f ? NULL : hash_lookup(argv[i]);
+    // its own process group, so Ctrl-C at the prompt leaves it running
+    Stage st = { .in_fd = sv[1], .out_fd = child_out, .pgid = job_control ? 0 : -1, .builtin = b, .func = f,
+                 .cgroup_fd = -1, .peer_fd = sv[0], .coproc = true };
+    fflush(stdout);
+    pid_t pid = launch_stage(&cmd, path, &st);
+    close(sv[1]);
+    close(child_out);
+    if (pid < 0) { close(sv[0]); return -1; }
+    if (job_control) setpgid(pid, pid);
+
+    char *hashed = path ? strdup(argv[i]) : NULL;
+    size_t len = strlen("coproc ") + strlen(name) + 1;
+    for (int k=i;argv[k];k++) len += strlen(argv[k]) + 1;
+    char *line = malloc(len), *w = line;
+    w += sprintf(w, "coproc %s", name);
+    for (int k=i;argv[k];k++) w += sprintf(w, " %s", argv[k]);
+    Job *j = job_create(job_control ? pid : getpgrp(), line, &pid, &hashed, argv + i, 1);
+    free(line);
+    job_assign_id(j);
+    if (interactive) printf("[%%%d] coproc %s, PID=%d\n", j->id, name, (int)pid);
+
+    if (!c) {
+        c = calloc(1, sizeof(Coproc));
+        c->name = strdup(name);
+        c->next = coprocs;
+        coprocs = c;
+    }
+    c->fd = shell_fd(sv[0]);
+    c->pid = pid;
+    c->len = c->pos = 0;
+    char var[256], num[16];
+    snprintf(var, sizeof(var), "%s_PID", name);
+    snprintf(num, sizeof(num), "%d", (int)pid);
+    var_set(var, num, false);
+    return 0;
+}
+
+// coreq [-v VAR] NAME [words...]
+// Send the words, space-separated, as one line to coprocess NAME and
+// print the line it answers with, or put it in VAR.
+static int builtin_coreq(char **argv) {
+    int i = 1;
+    const char *var = NULL;
+    if (argv[1] && strcmp(argv[1], "-v") == 0 && argv[2]) { var = argv[2]; i = 3; }
+    if (!argv[i]) { fprintf(stderr, "coreq [-v VAR] NAME [words...]\n"); return -1; }
+    Coproc *c = find_coproc(argv[i]);
+    if (!c || c->fd < 0) { fprintf(stderr, "coreq: %s: no coprocess running\n", argv[i]); return -1; }
+
+    size_t len = 1;
+    for (int k=i+1;argv[k];k++) len += strlen(argv[k]) + 1;
+    char small[512], *req = len <= sizeof(small) ? small : malloc(len), *w = req;
+    for (int k=i+1;argv[k];k++) w += sprintf(w, k > i+1 ? " %s" : "%s", argv[k]);
+    *w++ = '\n';
+    bool sent = true;
+    for (char *p = req; p < w && sent; ) {
+        ssize_t r = send(c->fd, p, (size_t)(w - p), MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) sent = false;
+        else p += r;
+    }
+    if (req != small) free(req);
+    if (!sent) {
+        fprintf(stderr, "coreq: %s: %s\n", c->name, strerror(errno));
+        coproc_close(c);
+        return -1;
+    }
+
+    Arena a = { 0 };
+    char *reply = coproc_read_line(&a, c);
+    int rc = 0;
+    if (!reply) {
+        if (c->fd < 0) fprintf(stderr, "coreq: %s: coprocess exited\n", c->name);
+        else if (!coreq_interrupted) fprintf(stderr, "coreq: %s: %s\n", c->name, strerror(errno));
+        else fputc('\n', stderr);   // past the ^C
+        rc = -1;
+    } else if (var) var_set(var, reply, false);
+    else puts(reply);
+    arena_free(&a);
+    return rc;
+}
+
+// ---------- remote fan-out ----------
+// `on` runs one command on many hosts at once through ssh, each run a job
+// of its own like parallel's. Connections go through a ControlMaster
+// socket per host that outlives the run (ControlPersist), so the next
+// `on` to the same hosts skips the handshake. Output comes back over a
+// pipe per host and stream, and goes out a line at a time with the host
+// in front: one writev per line, so hosts never interleave mid-line.
+// All the pipes are read from one epoll set (poll elsewhere).
+#define SSH_PERSIST "600"   // seconds an idle master connection stays up
+
+typedef struct {
+    const char *host;
+    int    fd;          // -1 at EOF
+    int    to;          // STDOUT_FILENO or STDERR_FILENO
+    size_t len;
+    char   buf[4096];   // the line so far; a full buffer goes out as one
+} RemoteStream;
+
+// Where the control sockets live: ours alone, or anyone could sit in the
+// middle of our connections.
+static const char *ssh_control_dir() {
+    static char dir[PATH_MAX];
+    if (*dir) return dir;
+    const char *run = var_get("XDG_RUNTIME_DIR");
+    if (run && *run) snprintf(dir, sizeof(dir), "%s/mysh-ssh", run);
+    else snprintf(dir, sizeof(dir), "/tmp/mysh-ssh-%d", (int)getuid());
+    struct stat st;
+    if ((mkdir(dir, 0700) < 0 && errno != EEXIST) || lstat(dir, &st) < 0) {
+        fprintf(stderr, "on: %s: %s\n", dir, strerror(errno));
+        *dir = '\0';
+        return NULL;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+        fprintf(stderr, "on: %s: not a private directory of ours\n", dir);
+        *dir = '\0';
+        return NULL;
+    }
+    return dir;
+}
+
+// Send on each complete line in s; at EOF what's left as well.
+static void remote_lines(RemoteStream *s, int width, bool eof) {
+    char *p = s->buf, *end = s->buf + s->len;
+    while (p < end) {
+        char *nl = memchr(p, '\n', (size_t)(end - p));
+        if (!nl && !eof && !(p == s->buf && s->len == sizeof(s->buf))) break;
+        size_t n = nl ? (size_t)(nl - p) : (size_t)(end - p);
+        char pre[128];
+        int pl = snprintf(pre, sizeof(pre), "%-*s | ", width, s->host);
+        struct iovec iov[3] = { { pre, (size_t)pl }, { p, n }, { "\n", 1 } };
+        (void)!writev(s->to, iov, 3);
+        p += n + (nl != NULL);
+    }
+    s->len = (size_t)(end - p);
+    memmove(s->buf, p, s->len);
+}
+
+// Take what's there from s. Returns true once it's at EOF, and closed.
+static bool remote_read(RemoteStream *s, int width) {
+    ssize_t n = read(s->fd, s->buf + s->len, sizeof(s->buf) - s->len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return false;
+    if (n > 0) {
+        s->len += (size_t)n;
+        remote_lines(s, width, false);
+        return false;
+    }
+    remote_lines(s, width, true);
+    close(s->fd);
+    s->fd = -1;
+    return true;
+}
+
+static Job *remote_launch(char **sargv, int host_at, const char *host, const char *cmdline, RemoteStream *out, RemoteStream *err) {
+    static Redir devnull = { .kind = R_IN, .fd = STDIN_FILENO, .word = "/dev/null" };
+    int o[2], e[2];
+    if (shell_pipe(o) < 0) { perror("pipe"); return NULL; }
+    if (shell_pipe(e) < 0) { perror("pipe"); close(o[0]); close(o[1]); return NULL; }
+    sargv[host_at] = (char *)host;
+    // fifty runs mustn't fight over the terminal: stdin is /dev/null
+    Command cmd = { .argv = sargv, .redirs = &devnull };
+    const char *path = hash_lookup(sargv[0]);
+    Stage st = { .in_fd = -1, .out_fd = o[1], .err_fd = e[1], .pgid = -1, .cgroup_fd = -1 };
+    pid_t pid = launch_stage(&cmd, path, &st);
+    close(o[1]);
+    close(e[1]);
+    if (pid < 0) { close(o[0]); close(e[0]); return NULL; }
+    *out = (RemoteStream){ .host = host, .fd = o[0], .to = STDOUT_FILENO };
+    *err = (RemoteStream){ .host = host, .fd = e[0], .to = STDERR_FILENO };
+
+    char *hashed = path ? strdup(sargv[0]) : NULL;
+    size_t len = strlen(host) + strlen(cmdline) + 8;
+    char *line = malloc(len);
+    snprintf(line, len, "on %s: %s", host, cmdline);
+    Job *j = job_create(getpgrp(), line, &pid, &hashed, sargv, 1);
+    free(line);
+    return j;
+}
+
+// on host[,host...] [host...] -- cmd [args...]
+// Run cmd on every host at once and wait for them all. cmd and its args
+// reach the remote shell joined by spaces, as with ssh, so quote a
+// pipeline to run it there. Fails if any host did; those are listed with
+// their status (255 is ssh's own failure).
+static int builtin_on(char **argv) {
+    int i = 1, nhosts = 0;
+    while (argv[i] && strcmp(argv[i], "--") != 0) i++;
+    if (!argv[i] || !argv[i+1] || i == 1) { fprintf(stderr, "on host[,host...] -- cmd [args...]\n"); return -1; }
+    char **cmdv = argv + i + 1;
+    size_t hosts_len = 0;
+    for (int k=1;k<i;k++) hosts_len += strlen(argv[k]) + 1;
+    char *hostbuf = malloc(hosts_len), *w = hostbuf;
+    char **hosts = malloc(sizeof(char *) * hosts_len);   // at most one per byte
+    for (int k=1;k<i;k++) {
+        for (const char *p = argv[k]; *p; ) {
+            size_t n = strcspn(p, ",");
+            if (n) { memcpy(w, p, n); w[n] = '\0'; hosts[nhosts++] = w; w += n + 1; }
+            p += n + (p[n] == ',');
+        }
+    }
+    const char *dir = nhosts ? ssh_control_dir() : NULL;
+    if (!dir) {
+        if (!nhosts) fprintf(stderr, "on: no hosts\n");
+        free(hosts); free(hostbuf);
+        return -1;
+    }
+
+    char control[PATH_MAX + 32];
+    snprintf(control, sizeof(control), "ControlPath=%s/%%C", dir);
+    char *prefix[] = { "ssh", "-T", "-o", "BatchMode=yes", "-o", "ControlMaster=auto",
+                       "-o", control, "-o", "ControlPersist=" SSH_PERSIST, "--", NULL };
+    int npre = (int)(sizeof(prefix) / sizeof(prefix[0])) - 1, ncmd = 0;
+    while (cmdv[ncmd]) ncmd++;
+    char **sargv = malloc(sizeof(char *) * (size_t)(npre + ncmd + 2));
+    memcpy(sargv, prefix, sizeof(char *) * (size_t)npre);
+    memcpy(sargv + npre + 1, cmdv, sizeof(char *) * (size_t)(ncmd + 1));
+    size_t cl = 1;
+    for (int k=0;k<ncmd;k++) cl += strlen(cmdv[k]) + 1;
+    char *cmdline = malloc(cl), *c = cmdline;
+    *c = '\0';
+    for (int k=0;k<ncmd;k++) c += sprintf(c, k ? " %s" : "%s", cmdv[k]);
+
+    int width = 0;
+    for (int h=0;h<nhosts;h++) if ((int)strlen(hosts[h]) > width) width = (int)strlen(hosts[h]);
+    Job **jobs = calloc((size_t)nhosts, sizeof(Job *));
+    RemoteStream *streams = calloc((size_t)nhosts * 2, sizeof(RemoteStream));
+    int nopen = 0, rc = 0;
+    fflush(stdout);
+    for (int h=0;h<nhosts;h++) {
+        if (!(jobs[h] = remote_launch(sargv, npre, hosts[h], cmdline, &streams[2*h], &streams[2*h+1]))) {
+            streams[2*h].fd = streams[2*h+1].fd = -1;
+            rc = -1;
+            continue;
+        }
+        nopen += 2;
+    }
+
+#ifdef __linux__
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) perror("epoll_create1");
+    for (int k=0;k<nhosts*2 && ep >= 0;k++) {
+        if (streams[k].fd < 0) continue;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &streams[k] };
+        epoll_ctl(ep, EPOLL_CTL_ADD, streams[k].fd, &ev);
+    }
+    while (nopen && ep >= 0) {
+        struct epoll_event evs[64];
+        int n = epoll_wait(ep, evs, 64, -1);
+        if (n < 0) { if (errno == EINTR) continue; perror("epoll_wait"); break; }
+        for (int k=0;k<n;k++) if (remote_read(evs[k].data.ptr, width)) nopen--;   // close() drops it from the set
+    }
+    if (ep >= 0) close(ep);
+#else
+    struct pollfd *pfd = malloc(sizeof(struct pollfd) * (size_t)nhosts * 2);
+    int *at = malloc(sizeof(int) * (size_t)nhosts * 2);
+    while (nopen) {
+        int np = 0;
+        for (int k=0;k<nhosts*2;k++) {
+            if (streams[k].fd < 0) continue;
+            pfd[np] = (struct pollfd){ .fd = streams[k].fd, .events = POLLIN };
+            at[np++] = k;
+        }
+        if (poll(pfd, (nfds_t)np, -1) < 0) { if (errno == EINTR) continue; perror("poll"); break; }
+        for (int k=0;k<np;k++)
+            if ((pfd[k].revents & (POLLIN | POLLHUP | POLLERR)) && remote_read(&streams[at[k]], width)) nopen--;
+    }
+    free(pfd);
+    free(at);
+#endif
+    for (int k=0;k<nhosts*2;k++) if (streams[k].fd >= 0) close(streams[k].fd);   // only after an error
+
+    // output is done, so the runs are too, or nearly: collect them
+    for (int h=0;h<nhosts;h++) {
+        Job *j = jobs[h];
+        if (!j) continue;
+        while (j->state == JOB_RUNNING && wait_any_child() == 0) {}
+        int st = j->state == JOB_DONE ? proc_status(j, 0) : 0;
+        if (st) { fprintf(stderr, "%-*s | exit %d\n", width, hosts[h], st); rc = -1; }
+        finish_foreground(j);
+    }
+    free(streams);
+    free(jobs);
+    free(cmdline);
+    free(sargv);
+    free(hosts);
+    free(hostbuf);
+    return rc;
+}
+
+// ---------- control flow ----------
+// Nodes run straight from the tree. Each pipeline's expansion scratch is
+// released once it has run, so a loop body runs in constant memory, and a
+// body whose words need no expansion runs its parsed Commands as they are.
+static void define_function(const Node *n) {
+    Func *f = calloc(1, sizeof(Func));
+    f->name = strdup(n->name);
+    Node *body;
+    if (parse_line(&f->arena, n->src, &body, false) < 0 || !body) {   // can't happen: it parsed once
+        arena_free(&f->arena);
+        free(f->name);
+        free(f);
+        return;
+    }
+    f->body = body;
+    for (Func **pp = &funcs; *pp; pp = &(*pp)->next) {
+        Func *old = *pp;
+        if (strcmp(old->name, f->name) != 0) continue;
+        *pp = old->next;
+        if (old->busy) old->dead = true;
+        else { arena_free(&old->arena); free(old->name); free(old); }
+        break;
+    }
+    f->next = funcs;
+    funcs = f;
+}
+
+// Run f with argv[1...] as $1...; $0 stays the shell's.
+static int call_function(Arena *a, Func *f, char **argv) {
+    char **saved = pos_args;
+    int nsaved = npos_args, n = 1;
+    while (argv[n]) n++;
+    char **args = arena_alloc(a, sizeof(char *) * (size_t)(n + 1));
+    args[0] = pos_args ? pos_args[0] : argv[0];
+    memcpy(args + 1, argv + 1, sizeof(char *) * (size_t)n);
+    pos_args = args;
+    npos_args = n;
+    f->busy++;
+    func_depth++;
+    int rc = exec_node(a, f->body);
+    if (returning) { returning = false; rc = return_status; }
+    func_depth--;
+    pos_args = saved;
+    npos_args = nsaved;
+    if (--f->busy == 0 && f->dead) { arena_free(&f->arena); free(f->name); free(f); }
+    return rc;
+}
+
+static bool unwinding() {
+    return breaking || continuing || returning || interrupted;
+}
+
+// After a loop body: whether to go round again.
+static bool loop_next() {
+    if (breaking) { breaking--; return false; }
+    if (continuing) return --continuing == 0;
+    return !returning && !interrupted;
+}
+
+static int exec_node(Arena *a, const Node *n) {
+    int rc = 0;
+    switch (n->kind) {
+    case N_PIPELINE: {
+        ArenaMark m = arena_mark(a);
+        rc = execute_line(a, n->pl, n->text);
+        arena_release(a, m);
+        if (n->pl->negate) rc = !rc;
+        break;
+    }
+    case N_LIST:
+        for (int i=0;i<n->nkids && !unwinding();i++) rc = exec_node(a, n->kids[i]);
+        break;
+    case N_AND: case N_OR:   // the right side isn't even expanded unless it runs
+        rc = exec_node(a, n->cond);
+        if (!unwinding() && (rc == 0) == (n->kind == N_AND)) rc = exec_node(a, n->body);
+        break;
+    case N_IF:
+        rc = exec_node(a, n->cond);
+        if (unwinding()) break;
+        if (rc == 0) rc = exec_node(a, n->body);
+        else rc = n->orelse ? exec_node(a, n->orelse) : 0;
+        break;
+    case N_WHILE: case N_UNTIL:
+        loop_depth++;
+        for (;;) {
+            int c = exec_node(a, n->cond);
+            if (unwinding() || (c == 0) != (n->kind == N_WHILE)) {
+                if (breaking || continuing) loop_next();   // break/continue in the condition
+                break;
+            }
+            rc = exec_node(a, n->body);
+            if (!loop_next()) break;
+        }
+        loop_depth--;
+        break;
+    case N_FOR: {
+        ArenaMark m = arena_mark(a);
+        const char *ifs = var_get("IFS");
+        Expander x = { .a = a, .split = true, .ifs = ifs ? ifs : " \t\n" };
+        if (n->words) for (char **w = n->words; *w; w++) expand_into(&x, *w);
+        else for (int k=1;k<npos_args;k++) {
+            x.v = arena_realloc(a, x.v, x.cap * sizeof(char *), (x.n + 2) * sizeof(char *));
+            x.cap = x.n + 2;
+            x.v[x.n++] = pos_args[k];
+        }
+        loop_depth++;
+        for (size_t i=0;i<x.n;i++) {
+            var_set(n->var, x.v[i], false);
+            rc = exec_node(a, n->body);
+            if (!loop_next()) break;
+        }
+        loop_depth--;
+        arena_release(a, m);
+        break;
+    }
+    case N_FUNCDEF:
+        define_function(n);
+        break;
+    }
+    last_status = rc;
+    return rc;
+}
+
+// ---------- command substitution ----------
+
+// The output of src, trailing newlines dropped, in a. The child writes
+// into a pipe we read to EOF; nothing touches the disk. A lone external
+// command is launched directly; anything else gets a forked copy of the
+// shell to run it.
+static char *command_output(Arena *a, const char *src, size_t n) {
+    char *text = arena_alloc(a, n + 1);
+    memcpy(text, src, n);
+    text[n] = '\0';
+    int fds[2];
+    if (shell_pipe(fds) < 0) { perror("pipe"); return ""; }
+
+    pid_t pid = -1;
+    Node *node;
+    bool direct = false;
+    if (parse_line(a, text, &node, false) < 0 || !node) {   // error, or nothing to run
+        close(fds[0]); close(fds[1]);
+        return "";
+    }
+    const Pipeline *pl = node->kind == N_PIPELINE ? node->pl : NULL;
+    if (pl && pl->ncmds == 1 && !pl->background && !pl->timed && !pl->negate && !pl->cmds[0]->pin) {
+        Command *cmd = expand_command(a, pl->cmds[0]);
+        if (cmd->argv[0] && !find_function(cmd->argv[0]) && !stage_builtin(cmd->argv, false)) {
+            direct = true;
+            Stage st = { .in_fd = -1, .out_fd = fds[1], .pgid = -1, .cgroup_fd = -1 };
+            pid = launch_stage(cmd, hash_lookup(cmd->argv[0]), &st);
+        }
+    }
+    if (!direct) {
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0) {
+            interactive = job_control = false;   // a subshell
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            dup2(fds[1], STDOUT_FILENO);
+            close(fds[0]); close(fds[1]);
+            subshell_close_fds(false);   // as a forked pipeline stage does
+            Arena sub = { 0 };
+            int rc = exec_node(&sub, node);
+            fflush(stdout);
+            _exit(rc);
+        }
+        if (pid < 0) perror("fork");
+    }
+    close(fds[1]);
+
+    size_t len = 0, cap = 256;
+    char *buf = malloc(cap);
+    for (;;) {
+        if (cap - len < 4096) buf = realloc(buf, cap *= 2);
+        ssize_t r = read(fds[0], buf + len, cap - len - 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        len += (size_t)r;
+    }
+    close(fds[0]);
+    int status = W_EXITCODE(direct ? launch_status : 1, 0);   // if it never started
+    if (pid > 0) while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    last_status = subst_status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+    while (len && buf[len-1] == '\n') len--;
+    char *out = arena_alloc(a, len + 1);
+    memcpy(out, buf, len);
+    out[len] = '\0';
+    free(buf);
+    return out;
+}
+
+// ---------- completion index ----------
+// Directory snapshots for Tab: sorted names, so a prefix costs a binary
+// search instead of a readdir. PATH directories are watched with inotify
+// and rescanned while the prompt sits idle, a directory per tick; those
+// inotify can't watch, and the directories file names are completed in,
+// are revalidated by mtime, which on a network mount is one stat rather
+// than a full listing. A change on PATH also drops the name from the
+// command hash, so a new binary that shadows an old one is picked up.
+typedef struct { char **v; size_t n, cap; } StrVec;
+
+static void sv_push(StrVec *sv, const char *s, size_t n, const char *suffix) {
+    if (sv->n == sv->cap) {
+        sv->cap = sv->cap ? sv->cap*2 : 64;
+        sv->v = realloc(sv->v, sizeof(char *) * sv->cap);
+    }
+    size_t sl = strlen(suffix);
+    char *c = malloc(n + sl + 1);
+    memcpy(c, s, n);
+    memcpy(c + n, suffix, sl + 1);
+    sv->v[sv->n++] = c;
+}
+
+static void sv_free(StrVec *sv) {
+    for (size_t i=0;i<sv->n;i++) free(sv->v[i]);
+    free(sv->v);
+}
+
+static int cmp_strp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+typedef struct {
+    char  *dir;
+    char **names;             // sorted; directories end in '/' unless exec_only
+    size_t n;
+    struct timespec mtime;
+    int    wd;                // inotify watch, -1 when mtime decides
+    bool   stale;
+    bool   exec_only;         // PATH entry: regular executables only
+    bool   racy;              // modified within a second of the scan
+} DirSnap;
+
+static int      compl_fd = -1;           // inotify
+static DirSnap *path_snaps = NULL;
+static size_t   npath_snaps = 0;
+static char    *path_snaps_var = NULL;   // PATH the snapshots were made for
+#define FILE_SNAPS 8
+static DirSnap  file_snaps[FILE_SNAPS];  // most recently used first
+
+static void compl_init() {
+#ifdef __linux__
+    compl_fd = shell_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+#endif
+}
+
+// A forked child that runs shell code rather than exec'ing drops the
+// descriptors only the shell itself should hold. A pipeline stage keeps
+// the coprocess sockets, since coreq may be what it runs; a coprocess
+// doesn't, or another coprocess would never see EOF from `coproc -c`.
+static void subshell_close_fds(bool coproc) {
+    if (coproc) for (Coproc *c = coprocs; c; c = c->next) coproc_close(c);
+#ifndef __linux__
+    if (self_pipe[1] >= 0) close(self_pipe[1]);
+    self_pipe[1] = -1;
+#endif
+    if (child_event_fd >= 0) close(child_event_fd);   // SIGCHLD is unblocked here anyway
+    if (hist_fd >= 0) close(hist_fd);
+    if (compl_fd >= 0) close(compl_fd);
+    child_event_fd = hist_fd = compl_fd = -1;
+}
+
+static void snap_free(DirSnap *d) {
+    for (size_t i=0;i<d->n;i++) free(d->names[i]);
+    free(d->names);
+    d->names = NULL;
+    d->n = 0;
+}
+
+static void snap_scan(DirSnap *d) {
+    snap_free(d);
+    d->stale = false;
+    DIR *dir = opendir(d->dir);
+    if (!dir) { d->mtime = (struct timespec){ 0 }; return; }
+    struct stat st;
+    if (fstat(dirfd(dir), &st) == 0) d->mtime = st.st_mtim;
+    // a change in the same clock tick as this scan would leave the mtime
+    // as it is; such a snapshot is only good until it is next asked for
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    d->racy = now.tv_sec - d->mtime.tv_sec < 2;
+    size_t cap = 0;
+    for (struct dirent *de; (de = readdir(dir)); ) {
+        const char *nm = de->d_name;
+        if (strcmp(nm, ".") == 0 || strcmp(nm, "..") == 0) continue;
+        bool isdir = de->d_type == DT_DIR, isreg = de->d_type == DT_REG;
+        if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK || (d->exec_only && isreg)) {
+            if (fstatat(dirfd(dir), nm, &st, 0) != 0) continue;
+            isdir = S_ISDIR(st.st_mode);
+            isreg = S_ISREG(st.st_mode);
+            if (d->exec_only && !(st.st_mode & 0111)) continue;
+        }
+        if (d->exec_only && !isreg) continue;
+        if (d->n == cap) {
+            cap = cap ? cap*2 : 64;
+            d->names = realloc(d->names, sizeof(char *) * cap);
+        }
+        size_t len = strlen(nm);
+        char *c = malloc(len + 2);
+        memcpy(c, nm, len);
+        strcpy(c + len, isdir && !d->exec_only ? "/" : "");
+        d->names[d->n++] = c;
+    }
+    closedir(dir);
+    qsort(d->names, d->n, sizeof(char *), cmp_strp);
+}
+
+// Whether the snapshot still describes the directory.
+static bool snap_valid(const DirSnap *d) {
+    if (d->stale || d->racy) return false;
+    if (d->wd >= 0) return true;
+    struct stat st;
+    if (stat(d->dir, &st) != 0) return d->n == 0;
+    return st.st_mtim.tv_sec == d->mtime.tv_sec && st.st_mtim.tv_nsec == d->mtime.tv_nsec;
+}
+
+static void snap_refresh(DirSnap *d) {
+    if (!snap_valid(d)) snap_scan(d);
+}
+
+// Push the names that start with pre, each prefixed with lead.
+static void snap_match(const DirSnap *d, const char *pre, size_t plen,
+                       const char *lead, size_t llen, StrVec *sv) {
+    size_t lo = 0, hi = d->n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (strncmp(d->names[mid], pre, plen) < 0) lo = mid + 1; else hi = mid;
+    }
+    bool dots = plen && pre[0] == '.';
+    for (size_t i = lo; i < d->n && strncmp(d->names[i], pre, plen) == 0; i++) {
+        const char *nm = d->names[i];
+        if (nm[0] == '.' && !dots) continue;
+        size_t len = strlen(nm);
+        if (!llen) { sv_push(sv, nm, len, ""); continue; }
+        char *full = malloc(llen + len + 1);
+        memcpy(full, lead, llen);
+        memcpy(full + llen, nm, len + 1);
+        sv_push(sv, full, llen + len, "");
+        free(full);
+    }
+}
+
+// One snapshot per PATH entry, rebuilt when PATH itself changes.
+static void compl_path_sync() {
+    const char *pv = path_var();
+    if (path_snaps_var && strcmp(path_snaps_var, pv) == 0) return;
+    for (size_t i=0;i<npath_snaps;i++) {
+#ifdef __linux__
+        if (path_snaps[i].wd >= 0) inotify_rm_watch(compl_fd, path_snaps[i].wd);
+#endif
+        snap_free(&path_snaps[i]);
+        free(path_snaps[i].dir);
+    }
+    free(path_snaps_var);
+    path_snaps_var = strdup(pv);
+    npath_snaps = 0;
+    size_t cap = 1;
+    for (const char *p = pv; *p; p++) cap += *p == ':';
+    path_snaps = realloc(path_snaps, sizeof(DirSnap) * cap);
+    for (const char *p = pv; ; ) {
+        size_t n = strcspn(p, ":");
+        DirSnap *d = &path_snaps[npath_snaps++];
+        *d = (DirSnap){ .stale = true, .exec_only = true, .wd = -1 };
+        d->dir = n ? strndup(p, n) : strdup(".");
+#ifdef __linux__
+        // "." follows cd, so only a stat can keep up with it
+        if (compl_fd >= 0 && d->dir[0] == '/')
+            d->wd = inotify_add_watch(compl_fd, d->dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                      IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+#endif
+        p += n;
+        if (!*p++) break;
+    }
+}
+
+// Take pending inotify events: mark their directories for a rescan and
+// the names for re-resolution.
+static void compl_drain() {
+#ifdef __linux__
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(compl_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            for (size_t i=0;i<npath_snaps;i++) {
+                if (path_snaps[i].wd != ev->wd) continue;
+                path_snaps[i].stale = true;
+                if (ev->mask & IN_IGNORED) path_snaps[i].wd = -1;   // watch gone with the directory
+            }
+            if (ev->len) hash_forget(ev->name);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+#endif
+}
+
+// Whether an idle tick has work to do.
+static bool compl_pending() {
+    for (size_t i=0;i<npath_snaps;i++) if (path_snaps[i].stale) return true;
+    return false;
+}
+
+// Rescan one stale PATH directory.
+static void compl_idle() {
+    compl_path_sync();
+    for (size_t i=0;i<npath_snaps;i++)
+        if (path_snaps[i].stale) { snap_scan(&path_snaps[i]); return; }
+}
+
+// hash -r: the next idle ticks rebuild everything.
+static void compl_forget() {
+    for (size_t i=0;i<npath_snaps;i++) path_snaps[i].stale = true;
+    for (int i=0;i<FILE_SNAPS;i++) file_snaps[i].stale = true;
+}
+
+static void compl_commands(StrVec *sv, const char *pre, size_t plen) {
+    compl_path_sync();
+    for (size_t i=0;i<npath_snaps;i++) {
+        snap_refresh(&path_snaps[i]);
+        snap_match(&path_snaps[i], pre, plen, "", 0, sv);
+    }
+}
+
+// File names for word, which may have a directory part.
+static void compl_files(StrVec *sv, const char *word, size_t wlen) {
+    const char *slash = memrchr(word, '/', wlen);
+    size_t dlen = slash ? (size_t)(slash - word) + 1 : 0;
+    char dir[PATH_MAX];
+    if (dlen && word[0] == '/') snprintf(dir, sizeof(dir), "%.*s", (int)dlen, word);
+    else snprintf(dir, sizeof(dir), "%s/%.*s", *shell_pwd ? shell_pwd : ".", (int)dlen, word);
+    int k = 0;
+    while (k < FILE_SNAPS - 1 && !(file_snaps[k].dir && strcmp(file_snaps[k].dir, dir) == 0)) k++;
+    DirSnap d = file_snaps[k];
+    if (!d.dir || strcmp(d.dir, dir) != 0) {   // not cached: evict the oldest
+        snap_free(&d);
+        free(d.dir);
+        d = (DirSnap){ .dir = strdup(dir), .stale = true, .wd = -1 };
+    }
+    memmove(&file_snaps[1], &file_snaps[0], sizeof(DirSnap) * (size_t)k);
+    file_snaps[0] = d;
+    snap_refresh(&file_snaps[0]);
+    snap_match(&file_snaps[0], word + dlen, wlen - dlen, word, dlen, sv);
+}
+
+// ---------- line editor ----------
+// Interactive input in raw mode, driven by the same poll as everything
+// else: keystrokes and child events are handled as they arrive, so a job
+// that finishes while the user types is announced above the line at once.
+// A batch of input (a paste, a burst over ssh) is applied as a whole and
+// then drawn as one frame, a single write that repaints only from the
+// first character that changed.
+typedef struct {
+    char  *buf;                 // the line, NUL-terminated
+    size_t len, cap, pos;       // pos: cursor, as a byte offset
+    char  *shown;               // what the screen holds after the prompt
+    size_t shown_len, shown_cap, shown_pos;
+    const char *prompt;         // cursor math sees only its last line
+    size_t prompt_len, prompt_cols;
+    size_t cols;                // terminal width
+    unsigned long hseq;         // history entry shown; hist_next for the new line
+    char  *saved;               // the new line, while browsing history
+    size_t saved_len;
+    bool   last_tab;            // a second Tab in a row lists the matches
+    bool   searching;           // Ctrl-R
+    bool   more;                // a continuation line, under PS2
+    char   pat[256];
+    size_t pat_len;
+    unsigned long match;        // seq of the current search match, 0 for none
+    char   label[300];          // the search prompt
+    char  *out;                 // the frame being built
+    size_t out_len, out_cap;
+} Editor;
+
+static struct termios term_cooked;   // the terminal as the shell found it
+static bool editor_on = false;
+
+static void term_raw() {
+    struct termios t = term_cooked;
+    t.c_iflag &= ~(ICRNL | INLCR | IXON | ISTRIP);
+    t.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &t);
+}
+
+// Put back the modes we started with; that also repairs a terminal a
+// crashed full-screen job left raw.
+static void term_restore() {
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &term_cooked);
+}
+
+static void editor_init() {
+    const char *term = var_get("TERM");
+    editor_on = !(term && strcmp(term, "dumb") == 0) && tcgetattr(STDIN_FILENO, &term_cooked) == 0;
+    if (editor_on) compl_init();
+}
+
+static void ed_out(Editor *ed, const char *s, size_t n) {
+    if (ed->out_len + n > ed->out_cap) {
+        while (ed->out_len + n > ed->out_cap) ed->out_cap = ed->out_cap ? ed->out_cap*2 : 1024;
+        ed->out = realloc(ed->out, ed->out_cap);
+    }
+    memcpy(ed->out + ed->out_len, s, n);
+    ed->out_len += n;
+}
+
+static void ed_csi(Editor *ed, size_t n, char cmd) {
+    char b[32];
+    ed_out(ed, b, (size_t)snprintf(b, sizeof(b), "\033[%zu%c", n, cmd));
+}
+
+static void ed_flush(Editor *ed) {
+    write_all(STDOUT_FILENO, ed->out, ed->out_len);
+    ed->out_len = 0;
+}
+
+// Columns that n bytes take: UTF-8 continuation bytes and CSI sequences
+// (prompt colours) take none.
+static size_t disp_cols(const char *s, size_t n) {
+    size_t c = 0;
+    for (size_t i=0;i<n;i++) {
+        if (s[i] == '\033' && i+1 < n && s[i+1] == '[') {
+            for (i += 2; i < n && !(s[i] >= 0x40 && s[i] <= 0x7e); i++) {}
+            continue;
+        }
+        if (((unsigned char)s[i] & 0xC0) != 0x80) c++;
+    }
+    return c;
+}
+
+static void ed_winsize(Editor *ed) {
+    struct winsize ws;
+    ed->cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col ? ws.ws_col : 80;
+}
+
+static void ed_set_prompt(Editor *ed, const char *p, size_t len) {
+    ed->prompt = p;
+    ed->prompt_len = len;
+    const char *nl = memrchr(p, '\n', len);
+    size_t start = nl ? (size_t)(nl - p) + 1 : 0;
+    ed->prompt_cols = disp_cols(p + start, len - start);
+}
+
+// Move the cursor between two screen offsets counted from the start of
+// the prompt's last line.
+static void ed_move(Editor *ed, size_t from, size_t to) {
+    size_t r1 = from / ed->cols, r2 = to / ed->cols, c1 = from % ed->cols, c2 = to % ed->cols;
+    if (r2 < r1) ed_csi(ed, r1 - r2, 'A');
+    else if (r2 > r1) ed_csi(ed, r2 - r1, 'B');
+    if (c2 == 0 && c1 != 0) ed_out(ed, "\r", 1);
+    else if (c2 > c1) ed_csi(ed, c2 - c1, 'C');
+    else if (c2 < c1) ed_csi(ed, c1 - c2, 'D');
+}
+
+// Bring the screen in line with the buffer, rewriting from the first
+// byte that differs from what is shown.
+static void ed_refresh(Editor *ed) {
+    size_t p = 0;
+    while (p < ed->shown_len && p < ed->len && ed->shown[p] == ed->buf[p]) p++;
+    while (p > 0 && p < ed->len && ((unsigned char)ed->buf[p] & 0xC0) == 0x80) p--;
+    size_t pc = ed->prompt_cols;
+    size_t cur = pc + disp_cols(ed->shown, ed->shown_pos);
+    if (p < ed->len || p < ed->shown_len) {
+        size_t end_old = pc + disp_cols(ed->shown, ed->shown_len);
+        size_t end = pc + disp_cols(ed->buf, ed->len);
+        ed_move(ed, cur, pc + disp_cols(ed->buf, p));
+        ed_out(ed, ed->buf + p, ed->len - p);
+        // past the last column the terminal defers the wrap; force it so
+        // the cursor is where the arithmetic says
+        if (ed->len > p && end % ed->cols == 0) ed_out(ed, "\r\n", 2);
+        if (end_old > end) ed_out(ed, "\033[J", 3);
+        cur = end;
+    }
+    ed_move(ed, cur, pc + disp_cols(ed->buf, ed->pos));
+    if (ed->len + 1 > ed->shown_cap) {
+        ed->shown_cap = ed->cap;
+        ed->shown = realloc(ed->shown, ed->shown_cap);
+    }
+    memcpy(ed->shown, ed->buf, ed->len);
+    ed->shown_len = ed->len;
+    ed->shown_pos = ed->pos;
+}
+
+// Wipe the prompt's last line and the buffer from the screen.
+static void ed_clear(Editor *ed) {
+    ed_move(ed, ed->prompt_cols + disp_cols(ed->shown, ed->shown_pos), 0);
+    ed_out(ed, "\r\033[J", 4);
+    ed->shown_len = ed->shown_pos = 0;
+}
+
+// Draw the prompt (all of it, or just its last line) and the buffer on a
+// clean row.
+static void ed_draw(Editor *ed, bool whole_prompt) {
+    const char *nl = whole_prompt ? NULL : memrchr(ed->prompt, '\n', ed->prompt_len);
+    size_t start = nl ? (size_t)(nl - ed->prompt) + 1 : 0;
+    ed_out(ed, ed->prompt + start, ed->prompt_len - start);
+    ed->shown_len = ed->shown_pos = 0;
+    ed_refresh(ed);
+}
+
+static void ed_reserve(Editor *ed, size_t n) {
+    if (ed->len + n + 1 <= ed->cap) return;
+    while (ed->len + n + 1 > ed->cap) ed->cap = ed->cap ? ed->cap*2 : 256;
+    ed->buf = realloc(ed->buf, ed->cap);
+}
+
+static void ed_insert(Editor *ed, const char *s, size_t n) {
+    ed_reserve(ed, n);
+    memmove(ed->buf + ed->pos + n, ed->buf + ed->pos, ed->len - ed->pos + 1);
+    memcpy(ed->buf + ed->pos, s, n);
+    ed->len += n;
+    ed->pos += n;
+}
+
+static void ed_erase(Editor *ed, size_t from, size_t to) {
+    memmove(ed->buf + from, ed->buf + to, ed->len - to + 1);
+    ed->len -= to - from;
+    if (ed->pos > to) ed->pos -= to - from;
+    else if (ed->pos > from) ed->pos = from;
+}
+
+static void ed_set(Editor *ed, const char *s, size_t n) {
+    ed->len = ed->pos = 0;
+    ed_reserve(ed, n);
+    memcpy(ed->buf, s, n);
+    ed->buf[n] = '\0';
+    ed->len = ed->pos = n;
+}
+
+static size_t ed_prev_char(const Editor *ed, size_t i) {
+    if (i > 0) i--;
+    while (i > 0 && ((unsigned char)ed->buf[i] & 0xC0) == 0x80) i--;
+    return i;
+}
+
+static size_t ed_next_char(const Editor *ed, size_t i) {
+    if (i < ed->len) i++;
+    while (i < ed->len && ((unsigned char)ed->buf[i] & 0xC0) == 0x80) i++;
+    return i;
+}
+
+static size_t ed_word_left(const Editor *ed, size_t i) {
+    while (i > 0 && isspace((unsigned char)ed->buf[i-1])) i--;
+    while (i > 0 && !isspace((unsigned char)ed->buf[i-1])) i--;
+    return i;
+}
+
+static size_t ed_word_right(const Editor *ed, size_t i) {
+    while (i < ed->len && isspace((unsigned char)ed->buf[i])) i++;
+    while (i < ed->len && !isspace((unsigned char)ed->buf[i])) i++;
+    return i;
+}
+
+static void ed_bell(Editor *ed) { ed_out(ed, "\a", 1); }
+
+// Up and down through the history ring; the line being typed is kept
+// aside and comes back below the newest entry.
+static void ed_history(Editor *ed, int dir) {
+    if (dir < 0 ? ed->hseq <= hist_first : ed->hseq >= hist_next) { ed_bell(ed); return; }
+    if (ed->hseq == hist_next) {
+        free(ed->saved);
+        ed->saved = malloc(ed->len + 1);
+        memcpy(ed->saved, ed->buf, ed->len + 1);
+        ed->saved_len = ed->len;
+    }
+    ed->hseq += dir;
+    if (ed->hseq == hist_next) ed_set(ed, ed->saved, ed->saved_len);
+    else ed_set(ed, hist_at(ed->hseq)->s, hist_at(ed->hseq)->len);
+}
+
+// ---- Ctrl-R ----
+// Incremental reverse search over the trigram index: the newest match
+// below limit, shown with the cursor on the matched text.
+static void ed_search_find(Editor *ed, unsigned long limit) {
+    if (ed->pat_len) {
+        size_t n;
+        unsigned long *seqs = hist_search(ed->pat, &n), found = 0;
+        for (size_t i = n; i-- > 0; ) if (seqs[i] < limit) { found = seqs[i]; break; }
+        free(seqs);
+        if (found) ed->match = found;
+        else ed_bell(ed);
+        if (found) {
+            const HistEntry *e = hist_at(found);
+            ed_set(ed, e->s, e->len);
+            const char *m = memmem(ed->buf, ed->len, ed->pat, ed->pat_len);
+            ed->pos = m ? (size_t)(m - ed->buf) : ed->len;
+        }
+        snprintf(ed->label, sizeof(ed->label), "(%sreverse-i-search)`%s': ", found ? "" : "failed ", ed->pat);
+    } else snprintf(ed->label, sizeof(ed->label), "(reverse-i-search)`': ");
+    ed_clear(ed);
+    ed_set_prompt(ed, ed->label, strlen(ed->label));
+    ed_draw(ed, true);
+}
+
+static void ed_search_start(Editor *ed) {
+    ed->searching = true;
+    ed->pat_len = 0;
+    ed->pat[0] = '\0';
+    ed->match = 0;
+    ed_search_find(ed, hist_next);
+}
+
+static void ed_search_end(Editor *ed) {
+    size_t len;
+    const char *p = line_prompt(ed->more, &len);
+    ed->searching = false;
+    ed_clear(ed);
+    ed_set_prompt(ed, p, len);
+    ed_draw(ed, false);
+}
+
+// ---- Tab ----
+static bool is_word_break(char c) { return strchr(" \t|&;<>()", c) != NULL; }
+
+// Command names: builtins, then every executable on PATH out of the
+// completion index.
+static void complete_commands(StrVec *sv, const char *pre, size_t plen) {
+    for (size_t i=0;i<NBUILTINS;i++)
+        if (strncmp(builtins[i].name, pre, plen) == 0) sv_push(sv, builtins[i].name, strlen(builtins[i].name), "");
+    compl_commands(sv, pre, plen);
+}
+
+// Replace buf[from..pos) with s, backslash-escaping what the lexer would
+// otherwise split or interpret.
+static void ed_replace_word(Editor *ed, size_t from, const char *s, size_t n) {
+    ed_erase(ed, from, ed->pos);
+    for (size_t i=0;i<n;i++) {
+        if (strchr(" \t\\'\"|&;<>()#", s[i])) ed_insert(ed, "\\", 1);
+        ed_insert(ed, &s[i], 1);
+    }
+}
+
+static void ed_list(Editor *ed, const StrVec *sv) {
+    size_t width = 0;
+    for (size_t i=0;i<sv->n;i++) if (strlen(sv->v[i]) > width) width = strlen(sv->v[i]);
+    width += 2;
+    size_t per_row = ed->cols / width ? ed->cols / width : 1;
+    size_t rows = (sv->n + per_row - 1) / per_row;
+    ed->pos = ed->len;
+    ed_refresh(ed);
+    ed_out(ed, "\r\n", 2);
+    for (size_t r=0;r<rows;r++) {
+        for (size_t c=0;c<per_row;c++) {
+            size_t i = c * rows + r;
+            if (i >= sv->n) break;
+            const char *v = sv->v[i];
+            ed_out(ed, v, strlen(v));
+            if ((c+1) * rows + r < sv->n) for (size_t k=strlen(v);k<width;k++) ed_out(ed, " ", 1);
+        }
+        ed_out(ed, "\r\n", 2);
+    }
+    ed_draw(ed, true);
+}
+
+static void ed_complete(Editor *ed) {
+    size_t ws = ed->pos;
+    while (ws > 0 && !(is_word_break(ed->buf[ws-1]) && !(ws > 1 && ed->buf[ws-2] == '\\'))) ws--;
+    // the word as the lexer will see it, escapes removed
+    char *word = malloc(ed->pos - ws + 1);
+    size_t wlen = 0;
+    for (size_t i=ws;i<ed->pos;i++) {
+        if (ed->buf[i] == '\\' && i+1 < ed->pos) i++;
+        word[wlen++] = ed->buf[i];
+    }
+    word[wlen] = '\0';
+    size_t k = ws;
+    while (k > 0 && (ed->buf[k-1] == ' ' || ed->buf[k-1] == '\t')) k--;
+    bool command = (k == 0 || strchr("|&;(", ed->buf[k-1])) && !memchr(word, '/', wlen);
+
+    StrVec sv = { 0 };
+    if (command) complete_commands(&sv, word, wlen);
+    else compl_files(&sv, word, wlen);
+    qsort(sv.v, sv.n, sizeof(char *), cmp_strp);
+    size_t u = 0;
+    for (size_t i=0;i<sv.n;i++) {
+        if (u && strcmp(sv.v[u-1], sv.v[i]) == 0) { free(sv.v[i]); continue; }
+        sv.v[u++] = sv.v[i];
+    }
+    sv.n = u;
+
+    if (sv.n == 0) ed_bell(ed);
+    else if (sv.n == 1) {
+        const char *c = sv.v[0];
+        size_t n = strlen(c);
+        ed_replace_word(ed, ws, c, n);
+        if (c[n-1] != '/') ed_insert(ed, " ", 1);
+    } else {
+        size_t lcp = strlen(sv.v[0]);
+        for (size_t i=1;i<sv.n;i++) {
+            size_t j = 0;
+            while (j < lcp && sv.v[i][j] == sv.v[0][j]) j++;
+            lcp = j;
+        }
+        if (lcp > wlen) ed_replace_word(ed, ws, sv.v[0], lcp);
+        else if (ed->last_tab) ed_list(ed, &sv);
+        else ed_bell(ed);
+    }
+    sv_free(&sv);
+    free(word);
+}
+
+enum { ED_MORE, ED_ACCEPT, ED_EOF };
+
+// Length of the key sequence at the start of in: 0 while an escape
+// sequence is still incomplete.
+static size_t key_len(const unsigned char *in, size_t n) {
+    if (in[0] != 27) {
+        size_t k = 1;
+        if (in[0] >= 0xC0) while (k < n && (in[k] & 0xC0) == 0x80 && k < 4) k++;
+        return k;
+    }
+    if (n < 2) return 0;
+    if (in[1] != '[' && in[1] != 'O') return 2;
+    for (size_t i=2;i<n;i++) if (in[i] >= 0x40 && in[i] <= 0x7e) return i+1;
+    return 0;
+}
+
+// Apply one key. Returns ED_ACCEPT on Enter, ED_EOF on Ctrl-D at an
+// empty line.
+static int ed_key(Editor *ed, const unsigned char *k, size_t n) {
+    bool tab = k[0] == '\t';
+    if (ed->searching) {
+        if (k[0] == CTRL('r')) { ed_search_find(ed, ed->match ? ed->match : hist_next); return ED_MORE; }
+        if (k[0] >= 32 && k[0] != 127 && n == 1 && ed->pat_len + 1 < sizeof(ed->pat)) {
+            ed->pat[ed->pat_len++] = (char)k[0];
+            ed->pat[ed->pat_len] = '\0';
+            ed_search_find(ed, ed->match ? ed->match + 1 : hist_next);
+            return ED_MORE;
+        }
+        if (k[0] == 127 || k[0] == CTRL('h')) {
+            if (ed->pat_len) ed->pat[--ed->pat_len] = '\0';
+            ed->match = 0;
+            ed_search_find(ed, hist_next);
+            return ED_MORE;
+        }
+        if (k[0] == CTRL('g') || k[0] == CTRL('c')) {
+            ed_set(ed, ed->saved ? ed->saved : "", ed->saved ? ed->saved_len : 0);
+            ed->hseq = hist_next;
+            ed_search_end(ed);
+            return ED_MORE;
+        }
+        ed_search_end(ed);
+        if (n == 1 && k[0] == 27) return ED_MORE;
+        // anything else ends the search and then does its usual job
+    }
+    ed->last_tab = false;
+
+    if (n >= 3 && k[0] == 27) {
+        char f = (char)k[n-1];
+        bool tilde = f == '~';
+        int num = tilde ? atoi((const char *)k + 2) : 0;
+        if (f == 'A') ed_history(ed, -1);
+        else if (f == 'B') ed_history(ed, +1);
+        else if (f == 'C') ed->pos = ed_next_char(ed, ed->pos);
+        else if (f == 'D') ed->pos = ed_prev_char(ed, ed->pos);
+        else if (f == 'H' || (tilde && (num == 1 || num == 7))) ed->pos = 0;
+        else if (f == 'F' || (tilde && (num == 4 || num == 8))) ed->pos = ed->len;
+        else if (tilde && num == 3 && ed->pos < ed->len) ed_erase(ed, ed->pos, ed_next_char(ed, ed->pos));
+        return ED_MORE;
+    }
+    if (n == 2 && k[0] == 27) {
+        if (k[1] == 'b') ed->pos = ed_word_left(ed, ed->pos);
+        else if (k[1] == 'f') ed->pos = ed_word_right(ed, ed->pos);
+        else if (k[1] == 'd') ed_erase(ed, ed->pos, ed_word_right(ed, ed->pos));
+        return ED_MORE;
+    }
+    switch (k[0]) {
+    case '\r': case '\n':
+        return ED_ACCEPT;
+    case CTRL('d'):
+        if (!ed->len) return ED_EOF;
+        if (ed->pos < ed->len) ed_erase(ed, ed->pos, ed_next_char(ed, ed->pos));
+        break;
+    case CTRL('c'):
+        ed->pos = ed->len;
+        ed_refresh(ed);
+        ed_out(ed, "^C\r\n", 4);
+        ed->len = ed->pos = 0;
+        ed->buf[0] = '\0';
+        ed->hseq = hist_next;
+        ed_draw(ed, true);
+        break;
+    case 127: case CTRL('h'):
+        if (ed->pos) ed_erase(ed, ed_prev_char(ed, ed->pos), ed->pos);
+        break;
+    case CTRL('a'): ed->pos = 0; break;
+    case CTRL('e'): ed->pos = ed->len; break;
+    case CTRL('b'): ed->pos = ed_prev_char(ed, ed->pos); break;
+    case CTRL('f'): ed->pos = ed_next_char(ed, ed->pos); break;
+    case CTRL('p'): ed_history(ed, -1); break;
+    case CTRL('n'): ed_history(ed, +1); break;
+    case CTRL('k'): ed_erase(ed, ed->pos, ed->len); break;
+    case CTRL('u'): ed_erase(ed, 0, ed->pos); break;
+    case CTRL('w'): ed_erase(ed, ed_word_left(ed, ed->pos), ed->pos); break;
+    case CTRL('l'):
+        ed_out(ed, "\033[H\033[2J", 7);
+        ed_draw(ed, true);
+        break;
+    case CTRL('r'):
+        free(ed->saved);
+        ed->saved = malloc(ed->len + 1);
+        memcpy(ed->saved, ed->buf, ed->len + 1);
+        ed->saved_len = ed->len;
+        ed_search_start(ed);
+        break;
+    case '\t':
+        ed_complete(ed);
+        break;
+    default:
+        if (k[0] >= 32 || k[0] >= 0x80) ed_insert(ed, (const char *)k, n);
+    }
+    ed->last_tab = tab;
+    return ED_MORE;
+}
+
+// Read one line from the terminal. Returns it without the newline, valid
+// until the next call, or NULL at Ctrl-D or end of input. more: the line
+// continues an unfinished command.
+static char *edit_line(bool more) {
+    static Editor ed;
+    static unsigned char in[4096];
+    size_t inlen = 0;
+    size_t plen;
+    long long t0 = mono_ns();
+    const char *prompt = line_prompt(more, &plen);
+    fflush(stdout);
+    term_raw();
+    ed_winsize(&ed);
+    ed_reserve(&ed, 0);
+    ed.len = ed.pos = 0;
+    ed.buf[0] = '\0';
+    ed.hseq = hist_next;
+    ed.searching = ed.last_tab = false;
+    ed.more = more;
+    ed_set_prompt(&ed, prompt, plen);
+    ed_draw(&ed, true);
+    ed_flush(&ed);
+    stat_record(ST_PROMPT, mono_ns() - t0);
+    if (compl_fd >= 0) compl_path_sync();   // idle ticks fill the index
+
+    int result = ED_MORE;
+    while (result == ED_MORE) {
+        struct pollfd pfd[3] = {
+            { .fd = STDIN_FILENO, .events = POLLIN },
+            { .fd = child_event_fd, .events = POLLIN },
+            { .fd = compl_fd, .events = POLLIN },
+        };
+        // a lone ESC is the Escape key unless the rest of a sequence
+        // follows; with nothing to read, stale completion dirs get rescanned
+        int timeout = inlen ? 50 : compl_pending() ? 0 : -1;
+        int r = poll(pfd, 3, timeout);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            result = ED_EOF;
+            break;
+        }
+        if (pfd[1].revents & POLLIN) {
+            reap_children();
+            if (done_jobs) {
+                // announce above the line, then put the line back
+                ed_clear(&ed);
+                ed_flush(&ed);
+                term_restore();
+                remove_done_jobs();
+                fflush(stdout);
+                term_raw();
+                ed_draw(&ed, true);
+            }
+        }
+        if (pfd[2].revents & POLLIN) compl_drain();
+        if (r == 0 && !inlen) { compl_idle(); continue; }
+        if (r == 0) {   // escape timed out: take it on its own
+            ed_key(&ed, in, 1);
+            memmove(in, in+1, --inlen);
+        }
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(STDIN_FILENO, in + inlen, sizeof(in) - inlen);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) { result = ED_EOF; break; }
+            inlen += (size_t)n;
+            ed_winsize(&ed);
+        }
+        // apply the whole batch, then draw once
+        size_t used = 0;
+        while (used < inlen && result == ED_MORE) {
+            size_t k = key_len(in + used, inlen - used);
+            if (!k) {
+                if (inlen - used == sizeof(in)) k = 1;   // nonsense; drop a byte
+                else break;
+            }
+            result = ed_key(&ed, in + used, k);
+            used += k;
+        }
+        memmove(in, in + used, inlen - used);
+        inlen -= used;
+        if (result == ED_MORE) ed_refresh(&ed);
+        ed_flush(&ed);
+    }
+    if (ed.searching) ed_search_end(&ed);
+    ed.pos = ed.len;
+    ed_refresh(&ed);
+    ed_out(&ed, "\r\n", 2);
+    ed_flush(&ed);
+    term_restore();
+    return result == ED_ACCEPT ? ed.buf : NULL;
+}
+
+// ---------- main loop ----------
+static void usage() {
+    fprintf(stderr, "usage: myshell [script [args...]]\n"
+                    "       myshell -c 'commands'\n");
+    exit(2);
+}
+
+// Point the reader at a script. Regular files are mapped whole; anything
+// else (a fifo, /dev/stdin) goes through the block reader.
+static int open_script(LineReader *r, const char *file) {
+    int fd = shell_fd(open(file, O_RDONLY | O_CLOEXEC));
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            madvise(m, (size_t)st.st_size, MADV_SEQUENTIAL);
+            r->map = m;
+            r->map_len = (size_t)st.st_size;
+            close(fd);
+            return 0;
+        }
+    }
+    r->fd = fd;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    LineReader input = { .fd = STDIN_FILENO };
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) usage();
+        input.fd = -1;
+        input.map = argv[2];
+        input.map_len = strlen(argv[2]);
+        // sh -c 'cmds' name args...: $0 and $1... after the string
+        if (argc > 3) vars_init(argv + 3, argc - 3);
+        else vars_init(argv, 1);
+    } else if (argc > 1) {
+        if (argv[1][0] == '-' && argv[1][1]) usage();
+        vars_init(argv + 1, argc - 1);
+        if (open_script(&input, argv[1]) < 0) {
+            fprintf(stderr, "mysh: %s: %s\n", argv[1], strerror(errno));
+            return 127;
+        }
+    } else {
+        vars_init(argv, 1);
+        interactive = isatty(STDIN_FILENO);
+    }
+    const char *l = var_get("MYSH_LAUNCHER");
+    if (l && *l) opt_launcher(l);
+    trace_init();
+    job_control = interactive;
+
+    install_signal_handlers();
+    builtins_init();
+    pwd_init();
+    if (interactive) {
+        load_history();
+        editor_init();
+    }
+
+    if (job_control) {
+        // Put shell in its own process group and take terminal
+        pid_t shell_pgid = getpid();
+        setpgid(shell_pgid, shell_pgid);
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+    }
+
+    Arena line_arena = { 0 };
+    char *pending = NULL;       // lines of a command still waiting for its end
+    size_t pending_len = 0, pending_cap = 0;
+
+    while (1) {
+        // announce jobs that finished while we were busy
+        reap_children();
+        remove_done_jobs();
+
+        bool more = pending != NULL;
+        char *line;
+        if (editor_on) {
+            line = edit_line(more);
+        } else {
+            if (interactive) print_prompt(more);
+            line = read_line(&input);
+            if (!line && interactive) putchar('\n');
+        }
+        if (!line) {
+            if (!pending) break;
+            // end of input inside a compound command: report it
+            Node *n;
+            parse_line(&line_arena, pending, &n, false);
+            free(pending);
+            pending = NULL;
+            last_status = 2;
+            break;
+        }
+        if (!more && !line[strspn(line, " \t")]) continue;
+
+        const char *src = line;
+        if (more) {
+            size_t n = strlen(line);
+            if (pending_len + n + 2 > pending_cap) {
+                size_t cap = pending_cap * 2 > pending_len + n + 2 ? pending_cap * 2 : pending_len + n + 2;
+                char *grown = realloc(pending, cap);
+                if (!grown) {
+                    perror("mysh");
+                    free(pending);
+                    pending = NULL;
+                    pending_len = pending_cap = 0;
+                    last_status = 2;
+                    continue;
+                }
+                pending = grown;
+                pending_cap = cap;
+            }
+            pending[pending_len++] = '\n';
+            memcpy(pending + pending_len, line, n + 1);
+            pending_len += n;
+            src = pending;
+            // a line that can't end the construct isn't worth a parse; an
+            // interactive shell still parses each line of a compound
+            // command, so a syntax error shows as soon as it's typed
+            if (!line_may_close(line) && !(interactive && parse_wait.keyword)) continue;
+        }
+
+        // parse once; words are slices into the line arena, and loop and
+        // if bodies run from the tree without being parsed again
+        Node *n;
+        interrupted = false;
+        long long t0 = mono_ns();
+        int rc = parse_line(&line_arena, src, &n, true);
+        long long t1 = mono_ns();
+        stat_record(ST_PARSE, t1 - t0);
+        if (rc == PARSE_MORE) {
+            if (!more) {
+                pending_len = strlen(line);
+                pending_cap = pending_len + 1;
+                pending = malloc(pending_cap);
+                if (!pending) { perror("mysh"); last_status = 2; }
+                else memcpy(pending, line, pending_len + 1);
+            }
+        } else {
+            // the whole command, once it's complete: a recalled entry
+            // runs as typed, here-doc body and all
+            if (interactive) add_history(src);
+            if (rc < 0) last_status = 2;
+            else if (n) exec_node(&line_arena, n);
+            long long t2 = mono_ns();
+            stat_record(ST_LINE, t2 - t0);
+            trace_event("line", NULL, "parse_ns,run_ns,status", t1 - t0, t2 - t1, (long long)last_status);
+            free(pending);
+            pending = NULL;
+            pending_len = pending_cap = 0;
+        }
+        arena_reset(&line_arena);
+    }
+
+    return last_status;
 }